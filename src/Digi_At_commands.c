@@ -408,8 +408,8 @@ bool digi_at_reply_write_command(uint8_t at_command, const char *command_data_st
 int8_t digi_at_analyze_and_reply_to_command(uint8_t *input_data, uint16_t size_input_data)
 {
 
-    LOG_WRN("Received input data size: %d\n", size_input_data);
-    LOG_HEXDUMP_DBG(input_data, size_input_data, "Received input data in hex:");
+    PACKET_LOG_DBG("Received input data size: %d", size_input_data);
+    PACKET_LOG_HEXDUMP_DBG(input_data, size_input_data, "Received input data in hex:");
 
     if( size_input_data < MINIMUM_SIZE_AT_COMMAND )
     {
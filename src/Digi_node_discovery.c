@@ -20,6 +20,9 @@
 
 /* Local variables                                                            */
 static struct node_discovery_reply_t node_discovery_reply;
+static struct k_spinlock node_discovery_reply_lock; // Written from the APS rx work queue and the Zigbee thread, read from the main loop
+
+extern uint16_t aps_frames_received_commissioning_cluster_counter;
 
 LOG_MODULE_REGISTER(Digi_node_discovery, LOG_LEVEL_DBG);
 
@@ -36,6 +39,21 @@ void digi_node_discovery_init(void)
 
     zb_conf_get_extended_node_identifier(node_discovery_reply.at_ni);
 
+    zigbee_aps_register_rx_handler(DIGI_PROFILE_ID, DIGI_COMMISSIONING_CLUSTER, DIGI_COMMISSIONING_SOURCE_ENDPOINT,
+                                   DIGI_COMMISSIONING_DESTINATION_ENDPOINT, digi_node_discovery_rx_handler);
+}
+
+/**@brief Handler of the APS frames received in the commissioning cluster
+ *
+ * @note Executed in the APS rx work queue.
+ */
+void digi_node_discovery_rx_handler(const zb_apsde_data_indication_t *ind, zb_uint8_t *payload, zb_uint16_t payload_size)
+{
+    aps_frames_received_commissioning_cluster_counter++;
+    if( is_a_digi_node_discovery_request((uint8_t *)payload, (int16_t)payload_size) )
+    {
+        PACKET_LOG_DBG("Xbee Node Discovery Device Request");
+    }
 }
 
 /**@brief This function evaluates if the last received APS frame is a Digi's Node Discover request
@@ -49,21 +67,23 @@ void digi_node_discovery_init(void)
 bool is_a_digi_node_discovery_request(uint8_t* input_data, int16_t size_of_input_data)
 {
     bool b_return = false;
-    LOG_WRN("is_a_digi_node_discovery_request, size %d", size_of_input_data);
-    LOG_HEXDUMP_WRN(input_data, size_of_input_data, "APS frame payload");
+    PACKET_LOG_DBG("is_a_digi_node_discovery_request, size %d", size_of_input_data);
+    PACKET_LOG_HEXDUMP_DBG(input_data, size_of_input_data, "APS frame payload");
     if( size_of_input_data >= 12 ) // TODO. I don't know if the size of this frame is constant. I know it should have at least 12 chars
     {
         if( ( input_data[10] == 'N' ) && ( input_data[11] == 'D' ) ) // ND command
         {
             if( input_data[1] >= 32 ) // Minimum valid discovery timeout
             {
-                LOG_WRN("Node Discovery request received");
+                PACKET_LOG_DBG("Node Discovery request received");
                 b_return = true;
+                k_spinlock_key_t key = k_spin_lock(&node_discovery_reply_lock);
                 node_discovery_reply.b_pending_request = true;
                 node_discovery_reply.first_character = input_data[0];
                 node_discovery_reply.max_reply_time_ms = (input_data[1] + 10) * 100;
                 node_discovery_reply.time_request_ms = k_uptime_get();
                 node_discovery_reply.time_reply_ms = node_discovery_reply.time_request_ms + node_discovery_reply.max_reply_time_ms/2; //TODO. It should be random, so not all TSC reply at the same time
+                k_spin_unlock(&node_discovery_reply_lock, key);
             }
         }
     }
@@ -72,33 +92,36 @@ bool is_a_digi_node_discovery_request(uint8_t* input_data, int16_t size_of_input
 
 /**@brief This function places in the APS output frame queue the reply to a node discovery request.
 *
+* @param[in]   first_character   First character of the Node Discovery request being replied
 */
-bool digi_node_discovery_reply(void)
+bool digi_node_discovery_reply(uint8_t first_character)
 {
     bool b_return = false;
     
-    if( zigbee_aps_get_output_frame_buffer_free_space() )
+    aps_output_frame_t *element = zigbee_aps_reserve_frame(APS_PRIORITY_CONTROL); // Built in place in the queue
+
+    if( element != NULL )
     {
         uint8_t i,j;
-        aps_output_frame_t element;
         zb_ieee_addr_t zb_long_address; // MAC address of this node
 
-        element.dst_addr.addr_short = COORDINATOR_SHORT_ADDRESS;
-        element.cluster_id = DIGI_COMMISSIONING_REPLY_CLUSTER;
-        element.src_endpoint = DIGI_COMMISSIONING_SOURCE_ENDPOINT;
-        element.dst_endpoint = DIGI_COMMISSIONING_DESTINATION_ENDPOINT;
+        element->dst_addr.addr_short = COORDINATOR_SHORT_ADDRESS;
+        element->cluster_id = DIGI_COMMISSIONING_REPLY_CLUSTER;
+        element->src_endpoint = DIGI_COMMISSIONING_SOURCE_ENDPOINT;
+        element->dst_endpoint = DIGI_COMMISSIONING_DESTINATION_ENDPOINT;
+        element->status_cb = digi_node_discovery_reply_status_cb;
         i = 0;
-        element.payload[i++] = (zb_uint8_t)node_discovery_reply.first_character; //First character of the Node Discovery request
-        element.payload[i++] = 'N'; //ND, node discovery
-        element.payload[i++] = 'D';
-        element.payload[i++] = 0;
-        element.payload[i++] = (zb_uint8_t)((uint16_t)(zb_get_short_address())>>8); //Short address, high byte
-        element.payload[i++] = (zb_uint8_t)(zb_get_short_address());//Short address, low byte
+        element->payload[i++] = (zb_uint8_t)first_character; //First character of the Node Discovery request
+        element->payload[i++] = 'N'; //ND, node discovery
+        element->payload[i++] = 'D';
+        element->payload[i++] = 0;
+        element->payload[i++] = (zb_uint8_t)((uint16_t)(zb_get_short_address())>>8); //Short address, high byte
+        element->payload[i++] = (zb_uint8_t)(zb_get_short_address());//Short address, low byte
 
         zb_get_long_address(zb_long_address); //MAC address of device
         for(j = 0; j<8; j++)
         {
-            element.payload[i++] = zb_long_address[7-j];
+            element->payload[i++] = zb_long_address[7-j];
         }       
         j = 0;
         while(j < 32)
@@ -106,30 +129,30 @@ bool digi_node_discovery_reply(void)
             if( node_discovery_reply.at_ni[j] == 0 ) break; //Null character found
             else
             {
-                element.payload[i++] = node_discovery_reply.at_ni[j]; //Node identifier string
+                element->payload[i++] = node_discovery_reply.at_ni[j]; //Node identifier string
                 j++;
             }
         }
-        element.payload[i++] = 0;
-        element.payload[i++] = 0xFF; //Parent address of node (always 0xFFFE for routers)
-        element.payload[i++] = 0xFE;
-        element.payload[i++] = 0x01; // Node type = 1 (router)
-        element.payload[i++] = 0;
-        element.payload[i++] = 0xC1; // Profile ID = 0xC105;
-        element.payload[i++] = 0x05;
-        element.payload[i++] = 0x10; // Manufacturer ID = 0x101E (We will start using a value from DIGI's Xbees)
-        element.payload[i++] = 0x1E;
-        element.payload[i++] = ((uint32_t)(PRODUCT_TYPE) >> 24) & 0xFF; // Product type
-        element.payload[i++] = ((uint32_t)(PRODUCT_TYPE) >> 16) & 0xFF;
-        element.payload[i++] = ((uint32_t)(PRODUCT_TYPE) >> 8) & 0xFF;
-        element.payload[i++] = (uint32_t)(PRODUCT_TYPE) & 0xFF;
-        element.payload[i++] = ((uint16_t)(MANUFACTURED_ID) >> 8) & 0xFF; // Manufactured ID
-        element.payload[i++] = (uint16_t)(MANUFACTURED_ID) & 0xFF;
-        element.payload[i++] = 0x2e; // TODO. Not sure what it means. It represents the RSSI or a related magnitude.
-        element.payload_size = (zb_uint8_t)i;
-        LOG_WRN("Node Discovery reply");
-        LOG_HEXDUMP_DBG(element.payload, element.payload_size, "Node Discovery reply payload");
-        if( enqueue_aps_frame(&element) ) b_return = true;
+        element->payload[i++] = 0;
+        element->payload[i++] = 0xFF; //Parent address of node (always 0xFFFE for routers)
+        element->payload[i++] = 0xFE;
+        element->payload[i++] = 0x01; // Node type = 1 (router)
+        element->payload[i++] = 0;
+        element->payload[i++] = 0xC1; // Profile ID = 0xC105;
+        element->payload[i++] = 0x05;
+        element->payload[i++] = 0x10; // Manufacturer ID = 0x101E (We will start using a value from DIGI's Xbees)
+        element->payload[i++] = 0x1E;
+        element->payload[i++] = ((uint32_t)(PRODUCT_TYPE) >> 24) & 0xFF; // Product type
+        element->payload[i++] = ((uint32_t)(PRODUCT_TYPE) >> 16) & 0xFF;
+        element->payload[i++] = ((uint32_t)(PRODUCT_TYPE) >> 8) & 0xFF;
+        element->payload[i++] = (uint32_t)(PRODUCT_TYPE) & 0xFF;
+        element->payload[i++] = ((uint16_t)(MANUFACTURED_ID) >> 8) & 0xFF; // Manufactured ID
+        element->payload[i++] = (uint16_t)(MANUFACTURED_ID) & 0xFF;
+        element->payload[i++] = 0x2e; // TODO. Not sure what it means. It represents the RSSI or a related magnitude.
+        element->payload_size = (zb_uint8_t)i;
+        PACKET_LOG_DBG("Node Discovery reply");
+        PACKET_LOG_HEXDUMP_DBG(element->payload, element->payload_size, "Node Discovery reply payload");
+        if( zigbee_aps_commit_frame(APS_PRIORITY_CONTROL) ) b_return = true;
     }
 
     if( !b_return ) LOG_ERR("Not free space of aps output frame queue");
@@ -137,6 +160,32 @@ bool digi_node_discovery_reply(void)
     return b_return;
 }
 
+/**@brief Executed when the transmission of a node discovery reply has finished. If the reply was
+ *        not delivered, it is sent again as long as the discovery time has not expired.
+ *
+ * @note Executed in the Zigbee thread.
+ */
+void digi_node_discovery_reply_status_cb(zb_uint16_t handle, zb_ret_t status, uint32_t latency_ms)
+{
+    if( status == RET_OK ) return;
+
+    uint64_t time_now_ms = k_uptime_get();
+    uint64_t time_retry_ms = time_now_ms + NODE_DISCOVERY_REPLY_RETRY_DELAY_MS;
+    bool b_retry = false;
+
+    k_spinlock_key_t key = k_spin_lock(&node_discovery_reply_lock);
+    if( time_retry_ms < node_discovery_reply.time_request_ms + node_discovery_reply.max_reply_time_ms )
+    {
+        node_discovery_reply.time_reply_ms = time_retry_ms;
+        node_discovery_reply.b_pending_request = true;
+        b_retry = true;
+    }
+    k_spin_unlock(&node_discovery_reply_lock, key);
+
+    if( b_retry ) LOG_WRN("Node Discovery reply not delivered (status %d), retrying", status);
+    else LOG_ERR("Node Discovery reply not delivered (status %d)", status);
+}
+
 /**@brief This function checks if there is a node discovery request pending to be replied, and, in that case
  *        schedules the function that will reply to that request.
  *
@@ -145,13 +194,18 @@ bool digi_node_discovery_reply(void)
  */
 void digi_node_discovery_request_manager(void)
 {
-    if( node_discovery_reply.b_pending_request )
+    bool b_reply = false;
+    uint8_t first_character = 0;
+    uint64_t time_now_ms = k_uptime_get();
+
+    k_spinlock_key_t key = k_spin_lock(&node_discovery_reply_lock);
+    if( node_discovery_reply.b_pending_request && ( time_now_ms >= node_discovery_reply.time_reply_ms ) )
     {
-        uint64_t time_now_ms = k_uptime_get();
-        if( time_now_ms >= node_discovery_reply.time_reply_ms )
-        {
-            node_discovery_reply.b_pending_request = false;
-            digi_node_discovery_reply();
-        }
+        node_discovery_reply.b_pending_request = false;
+        first_character = node_discovery_reply.first_character;
+        b_reply = true;
     }
+    k_spin_unlock(&node_discovery_reply_lock, key);
+
+    if( b_reply ) digi_node_discovery_reply(first_character);
 }
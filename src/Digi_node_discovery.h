@@ -8,6 +8,8 @@
 
 #define DIGI_NODE_DISCOVERY_REPLY_PAYLOAD_SIZE_MAX 60 //Considering that maximum size of node identifier is 32 chars
 
+#define NODE_DISCOVERY_REPLY_RETRY_DELAY_MS 200 // Delay before sending again a reply that was not delivered
+
 struct node_discovery_reply_t {
     bool    b_pending_request; // There is a pending node discovery request
     uint8_t first_character; // First character of the last node discovery request
@@ -19,8 +21,10 @@ struct node_discovery_reply_t {
 
 /* Function prototypes                                                        */
 void digi_node_discovery_init(void);
+void digi_node_discovery_rx_handler(const zb_apsde_data_indication_t *ind, zb_uint8_t *payload, zb_uint16_t payload_size);
 bool is_a_digi_node_discovery_request(uint8_t* input_data, int16_t size_of_input_data);
-bool digi_node_discovery_reply(void);
+bool digi_node_discovery_reply(uint8_t first_character);
+void digi_node_discovery_reply_status_cb(zb_uint16_t handle, zb_ret_t status, uint32_t latency_ms);
 void digi_node_discovery_request_manager(void);
 
 #endif /* DIGI_NODE_DISCOVERY_H_ */
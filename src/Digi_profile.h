@@ -12,6 +12,15 @@
 #define DIGI_BINARY_VALUE_SOURCE_ENDPOINT 232
 #define DIGI_BINARY_VALUE_DESTINATION_ENDPOINT 232
 
+#define DIGI_AGGREGATED_DATA_CLUSTER 0x0019 // Several TCU frames, each one preceded by its length (binary value endpoints)
+#define DIGI_FRAGMENTED_DATA_CLUSTER 0x001A // Fragment of a TCU frame: message id, index, count, data (binary value endpoints)
+
+/* Format of the aggregated and fragmented uplink frames, shared with the coordinator firmware
+ * (src_network_coordinator) so both ends split and rebuild the TCU frames the same way */
+#define DIGI_UNENCRYPTED_PAYLOAD_MAX 82 // Biggest APS payload sent to the coordinator in a single frame
+#define DIGI_FRAGMENT_HEADER_SIZE 3     // Message id, fragment index and fragment count
+#define DIGI_FRAGMENT_DATA_MAX (DIGI_UNENCRYPTED_PAYLOAD_MAX - DIGI_FRAGMENT_HEADER_SIZE) // Data of every fragment but the last one
+
 #define DIGI_COMMISSIONING_CLUSTER 0x0015
 #define DIGI_COMMISSIONING_REPLY_CLUSTER 0x0095
 #define DIGI_COMMISSIONING_SOURCE_ENDPOINT 230
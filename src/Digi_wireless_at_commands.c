@@ -10,6 +10,7 @@
 
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <string.h>
 
 #include <zboss_api.h>
 
@@ -19,25 +20,50 @@
 
 LOG_MODULE_REGISTER(Digi_wireless_at_commands, LOG_LEVEL_DBG);
 
-static bool b_pending_ping_cmd;             // A ping command has been received and is pending to be replied
-static uint8_t ping_first_char;             // First char of ping command
-static uint8_t ping_second_char;            // Second char of ping command
-static bool b_pending_read_cmd;             // A read AT command has been received and is pending to be replied
-static enum wireless_at_read_cmd_e read_cmd;       // Enumerative of read AT command
-static uint8_t read_cmd_first_char;                // First char of read AT command
-static uint8_t read_cmd_second_char;               // Second char of read AT command
-static uint8_t read_cmd_sequence_number;           // Read AT command sequence number
-static uint8_t read_cmd_reply_size;                // Number of bytes of reply
-static uint8_t read_cmd_reply[MAX_SIZE_AT_COMMAND_REPLY]; // Buffer containing the reply
+/* Commands received in the APS rx work queue are handed over to the main loop as whole messages,
+ * so a command arriving while another one is pending can not corrupt it */
+K_MSGQ_DEFINE(wireless_read_request_queue, sizeof(wireless_at_read_request_t), WIRELESS_REQUEST_QUEUE_SIZE, 1);
+K_MSGQ_DEFINE(wireless_ping_request_queue, sizeof(wireless_ping_request_t), WIRELESS_REQUEST_QUEUE_SIZE, 1);
+
+static uint16_t wireless_replies_not_delivered_counter = 0; // Replies whose transmission failed
+static atomic_t wireless_requests_dropped_counter = ATOMIC_INIT(0); // Requests lost because the queue was full
 
 /**@brief This function initializes the Digi_wireless_at_commands firmware module
  *
  */
 void digi_wireless_at_init(void)
 {
-    b_pending_ping_cmd = false;
-    b_pending_read_cmd = false;
-    read_cmd = NO_SUPPORTED_EXT_READ_AT_CMD;
+    k_msgq_purge(&wireless_read_request_queue);
+    k_msgq_purge(&wireless_ping_request_queue);
+
+    zigbee_aps_register_rx_handler(DIGI_PROFILE_ID, DIGI_AT_COMMAND_CLUSTER, DIGI_AT_COMMAND_SOURCE_ENDPOINT,
+                                   DIGI_AT_COMMAND_DESTINATION_ENDPOINT, digi_wireless_at_command_rx_handler);
+    zigbee_aps_register_rx_handler(DIGI_PROFILE_ID, DIGI_AT_PING_CLUSTER, DIGI_AT_PING_SOURCE_ENDPOINT,
+                                   DIGI_AT_PING_DESTINATION_ENDPOINT, digi_wireless_ping_rx_handler);
+}
+
+/**@brief Handler of the APS frames received in the AT command cluster
+ *
+ * @note Executed in the APS rx work queue.
+ */
+void digi_wireless_at_command_rx_handler(const zb_apsde_data_indication_t *ind, zb_uint8_t *payload, zb_uint16_t payload_size)
+{
+    if( is_a_digi_read_at_command((uint8_t *)payload, (int16_t)payload_size) )
+    {
+        PACKET_LOG_DBG("Xbee read AT command received");
+    }
+}
+
+/**@brief Handler of the APS frames received in the ping cluster
+ *
+ * @note Executed in the APS rx work queue.
+ */
+void digi_wireless_ping_rx_handler(const zb_apsde_data_indication_t *ind, zb_uint8_t *payload, zb_uint16_t payload_size)
+{
+    if( is_a_ping_command((uint8_t *)payload, (int16_t)payload_size) )
+    {
+        PACKET_LOG_DBG("PING");
+    }
 }
 
 /**@brief This function evaluates if the last received APS frame is a Digi's ping command
@@ -53,14 +79,157 @@ bool is_a_ping_command(uint8_t* input_data, int16_t size_of_input_data)
     bool b_return = false;
     if (size_of_input_data == 2) // We got this value with the sniffer and reverse engineering
     {
+        wireless_ping_request_t request = { .first_char = input_data[0], .second_char = input_data[1] };
+
         b_return = true;
-        b_pending_ping_cmd = true;
-        ping_first_char = input_data[0];
-        ping_second_char = input_data[1];
+        if (k_msgq_put(&wireless_ping_request_queue, &request, K_NO_WAIT) != 0) atomic_inc(&wireless_requests_dropped_counter);
     }
     return b_return;
 }
 
+/**@brief Reply to the read AT command MY: short address of the device
+ *
+ */
+static uint8_t digi_wireless_at_get_my(uint8_t *reply)
+{
+    uint16_t short_address = (uint16_t)zb_get_short_address();
+    reply[0] = (uint8_t)(short_address >> 8);
+    reply[1] = (uint8_t)short_address;
+    return 2;
+}
+
+/**@brief Reply to the read AT command NI: node identifier, a blank if it is empty
+ *
+ */
+static uint8_t digi_wireless_at_get_ni(uint8_t *reply)
+{
+    uint8_t reply_size = zb_conf_get_extended_node_identifier(reply);
+    if (reply_size == 0)
+    {
+        reply_size = 1;
+        reply[0] = ' ';
+    }
+    return reply_size;
+}
+
+/**@brief Reply to the read AT command NK: the network key is never disclosed, it is replied with zeros
+ *
+ */
+static uint8_t digi_wireless_at_get_nk(uint8_t *reply)
+{
+    memset(reply, 0, 16);
+    return 16;
+}
+
+/* Supported read AT commands, sorted by key to be found with a binary search */
+static const wireless_at_read_cmd_entry_t wireless_at_read_cmd_table[] = {
+    { WIRELESS_AT_KEY('%', 'V'), EXT_READ_AT_percV, 2, NULL, { 0x0C, 0xE4 } },
+    { WIRELESS_AT_KEY('A', 'I'), EXT_READ_AT_AI, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('A', 'R'), EXT_READ_AT_AR, 1, NULL, { 255 } },
+    { WIRELESS_AT_KEY('B', 'D'), EXT_READ_AT_BD, 1, NULL, { 4 } },
+    { WIRELESS_AT_KEY('B', 'H'), EXT_READ_AT_BH, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('C', 'C'), EXT_READ_AT_CC, 1, NULL, { '+' } },
+    { WIRELESS_AT_KEY('C', 'E'), EXT_READ_AT_CE, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('C', 'H'), EXT_READ_AT_CH, 1, NULL, { 0x17 } },
+    { WIRELESS_AT_KEY('C', 'I'), EXT_READ_AT_CI, 2, NULL, { 0, 0x11 } },
+    { WIRELESS_AT_KEY('C', 'R'), EXT_READ_AT_CR, 1, NULL, { 3 } },
+    { WIRELESS_AT_KEY('C', 'T'), EXT_READ_AT_CT, 2, NULL, { 0, 0x64 } },
+    { WIRELESS_AT_KEY('D', '0'), EXT_READ_AT_D0, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('D', '1'), EXT_READ_AT_D1, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('D', '2'), EXT_READ_AT_D2, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('D', '3'), EXT_READ_AT_D3, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('D', '4'), EXT_READ_AT_D4, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('D', '5'), EXT_READ_AT_D5, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('D', '6'), EXT_READ_AT_D6, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('D', '7'), EXT_READ_AT_D7, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('D', '8'), EXT_READ_AT_D8, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('D', '9'), EXT_READ_AT_D9, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('D', 'B'), EXT_READ_AT_DB, 1, NULL, { 50 } },
+    { WIRELESS_AT_KEY('D', 'D'), EXT_READ_AT_DD, 4, NULL, { 0, 0, 0, 1 } },
+    { WIRELESS_AT_KEY('D', 'E'), EXT_READ_AT_DE, 1, NULL, { 0xE8 } },
+    { WIRELESS_AT_KEY('D', 'H'), EXT_READ_AT_DH, 4, NULL, { 0, 0, 0, 0 } },
+    { WIRELESS_AT_KEY('D', 'L'), EXT_READ_AT_DL, 4, NULL, { 0, 0, 0, 0 } },
+    { WIRELESS_AT_KEY('E', 'A'), EXT_READ_AT_EA, 2, NULL, { 0, 1 } },
+    { WIRELESS_AT_KEY('E', 'E'), EXT_READ_AT_EE, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('E', 'O'), EXT_READ_AT_EO, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('G', 'T'), EXT_READ_AT_GT, 2, NULL, { 0x03, 0xE8 } },
+    { WIRELESS_AT_KEY('H', 'V'), EXT_READ_AT_HV, 2, NULL, { 0x00, 0x01 } },
+    { WIRELESS_AT_KEY('I', 'C'), EXT_READ_AT_IC, 2, NULL, { 0, 0 } },
+    { WIRELESS_AT_KEY('I', 'D'), EXT_READ_AT_ID, 8, NULL, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } },
+    { WIRELESS_AT_KEY('I', 'I'), EXT_READ_AT_II, 2, NULL, { 0xFF, 0xFF } },
+    { WIRELESS_AT_KEY('I', 'R'), EXT_READ_AT_IR, 2, NULL, { 0, 0 } },
+    { WIRELESS_AT_KEY('J', 'N'), EXT_READ_AT_JN, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('J', 'V'), EXT_READ_AT_JV, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('K', 'Y'), EXT_READ_AT_KY, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('L', 'T'), EXT_READ_AT_LT, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('M', 'P'), EXT_READ_AT_MP, 2, NULL, { 0xFF, 0xFE } },
+    { WIRELESS_AT_KEY('M', 'Y'), EXT_READ_AT_MY, 0, digi_wireless_at_get_my, { 0 } },
+    { WIRELESS_AT_KEY('N', 'B'), EXT_READ_AT_NB, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('N', 'C'), EXT_READ_AT_NC, 1, NULL, { 20 } },
+    { WIRELESS_AT_KEY('N', 'H'), EXT_READ_AT_NH, 1, NULL, { 30 } },
+    { WIRELESS_AT_KEY('N', 'I'), EXT_READ_AT_NI, 0, digi_wireless_at_get_ni, { 0 } },
+    { WIRELESS_AT_KEY('N', 'J'), EXT_READ_AT_NJ, 1, NULL, { 255 } },
+    { WIRELESS_AT_KEY('N', 'K'), EXT_READ_AT_NK, 0, digi_wireless_at_get_nk, { 0 } },
+    { WIRELESS_AT_KEY('N', 'P'), EXT_READ_AT_NP, 1, NULL, { 255 } },
+    { WIRELESS_AT_KEY('N', 'T'), EXT_READ_AT_NT, 1, NULL, { 60 } },
+    { WIRELESS_AT_KEY('N', 'W'), EXT_READ_AT_NW, 2, NULL, { 0, 10 } },
+    { WIRELESS_AT_KEY('O', 'I'), EXT_READ_AT_OI, 2, NULL, { 0x00, 0x01 } },
+    { WIRELESS_AT_KEY('O', 'P'), EXT_READ_AT_OP, 8, NULL, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01 } },
+    { WIRELESS_AT_KEY('P', '2'), EXT_READ_AT_P2, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('P', '3'), EXT_READ_AT_P3, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('P', '4'), EXT_READ_AT_P4, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('P', '5'), EXT_READ_AT_P5, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('P', '6'), EXT_READ_AT_P6, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('P', '7'), EXT_READ_AT_P7, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('P', '8'), EXT_READ_AT_P8, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('P', '9'), EXT_READ_AT_P9, 1, NULL, { 1 } },
+    { WIRELESS_AT_KEY('P', 'D'), EXT_READ_AT_PD, 2, NULL, { 0x00, 0x00 } },
+    { WIRELESS_AT_KEY('P', 'L'), EXT_READ_AT_PL, 1, NULL, { 4 } },
+    { WIRELESS_AT_KEY('P', 'O'), EXT_READ_AT_PO, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('P', 'P'), EXT_READ_AT_PP, 1, NULL, { 8 } },
+    { WIRELESS_AT_KEY('P', 'R'), EXT_READ_AT_PR, 4, NULL, { 0x00, 0x00, 0xE7, 0xFF } },
+    { WIRELESS_AT_KEY('R', 'O'), EXT_READ_AT_RO, 1, NULL, { 3 } },
+    { WIRELESS_AT_KEY('S', 'B'), EXT_READ_AT_SB, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('S', 'C'), EXT_READ_AT_SC, 2, NULL, { 0x07, 0xFF } },
+    { WIRELESS_AT_KEY('S', 'D'), EXT_READ_AT_SD, 1, NULL, { 3 } },
+    { WIRELESS_AT_KEY('S', 'E'), EXT_READ_AT_SE, 1, NULL, { 0xE8 } },
+    { WIRELESS_AT_KEY('S', 'M'), EXT_READ_AT_SM, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('S', 'N'), EXT_READ_AT_SN, 2, NULL, { 0, 1 } },
+    { WIRELESS_AT_KEY('S', 'O'), EXT_READ_AT_SO, 1, NULL, { 0 } },
+    { WIRELESS_AT_KEY('S', 'P'), EXT_READ_AT_SP, 2, NULL, { 0, 32 } },
+    { WIRELESS_AT_KEY('S', 'T'), EXT_READ_AT_ST, 2, NULL, { 13, 88 } },
+    { WIRELESS_AT_KEY('T', 'P'), EXT_READ_AT_TP, 2, NULL, { 0x00, 0x16 } },
+    { WIRELESS_AT_KEY('V', '+'), EXT_READ_AT_Vplus, 2, NULL, { 0, 0 } },
+    { WIRELESS_AT_KEY('V', 'R'), EXT_READ_AT_VR, 2, NULL, { 0x00, 0x01 } },
+    { WIRELESS_AT_KEY('W', 'H'), EXT_READ_AT_WH, 2, NULL, { 0, 0 } },
+    { WIRELESS_AT_KEY('Z', 'S'), EXT_READ_AT_ZS, 1, NULL, { 2 } },
+};
+
+BUILD_ASSERT(ARRAY_SIZE(wireless_at_read_cmd_table) == NUMBER_OF_WIRELESS_AT_READ_COMMANDS,
+             "Every read AT command needs an entry in wireless_at_read_cmd_table");
+
+/**@brief Entry of the table of read AT commands of a command (binary search in the table)
+ *
+ * @param[in]   key   WIRELESS_AT_KEY of the command
+ *
+ * @return Entry of the command, NULL if it is not supported
+ */
+static const wireless_at_read_cmd_entry_t *digi_wireless_find_read_at_cmd(uint16_t key)
+{
+    uint8_t low = 0;
+    uint8_t high = ARRAY_SIZE(wireless_at_read_cmd_table);
+
+    while( low < high )
+    {
+        uint8_t middle = ( low + high ) / 2;
+
+        if( wireless_at_read_cmd_table[middle].key == key ) return &wireless_at_read_cmd_table[middle];
+        if( wireless_at_read_cmd_table[middle].key < key ) low = middle + 1;
+        else high = middle;
+    }
+    return NULL;
+}
+
 /**@brief This function evaluates if the last received APS frame is a Digi's read AT command
  *
  * @param[in]   input_data   Pointer to payload of received APS frame
@@ -72,687 +241,107 @@ bool is_a_ping_command(uint8_t* input_data, int16_t size_of_input_data)
 bool is_a_digi_read_at_command(uint8_t* input_data, int16_t size_of_input_data)
 {
     bool b_return = false;
-    enum wireless_at_read_cmd_e received_cmd = NO_SUPPORTED_EXT_READ_AT_CMD;
-    uint8_t i, j;
-    uint16_t uitemp;
     if (size_of_input_data == 16) // We got this value with the sniffer and reverse engineering
     {
         if ((input_data[1] == 0) && (input_data[2] == 2) && (input_data[12] == 0) && (input_data[13] == 0))
         // We got the above values with the sniffer and reverse engineering
         {
-            if (input_data[14] == 'A')
-            {
-                if (input_data[15] == 'I')
-                {
-                    received_cmd = EXT_READ_AT_AI;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == 'R')
-                {
-                    received_cmd = EXT_READ_AT_AR;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 255;
-                }
-            }
-            else if (input_data[14] == 'B')
-            {
-                if (input_data[15] == 'D')
-                {
-                    received_cmd = EXT_READ_AT_BD;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 4;
-                }
-                else if (input_data[15] == 'H')
-                {
-                    received_cmd = EXT_READ_AT_BH;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-            }
-            else if (input_data[14] == 'C')
-            {
-                if (input_data[15] == 'C')
-                {
-                    received_cmd = EXT_READ_AT_CC;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = '+';
-                }
-                else if (input_data[15] == 'E')
-                {
-                    received_cmd = EXT_READ_AT_CE;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == 'H')
-                {
-                    received_cmd = EXT_READ_AT_CH;  //TODO
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0x17;
-                }
-                else if (input_data[15] == 'I')
-                {
-                    received_cmd = EXT_READ_AT_CI;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0;
-                    read_cmd_reply[1] = 0x11;                    
-                }
-                else if (input_data[15] == 'R')
-                {
-                    received_cmd = EXT_READ_AT_CR;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 3;
-                }
-                else if (input_data[15] == 'T')
-                {
-                    received_cmd = EXT_READ_AT_CT;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0;
-                    read_cmd_reply[1] = 0x64; 
-                }                
-            }
-            else if (input_data[14] == 'D')
-            {
-                if (input_data[15] == '0')
-                {
-                    received_cmd = EXT_READ_AT_D0;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-                else if (input_data[15] == '1')
-                {
-                    received_cmd = EXT_READ_AT_D1;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == '2')
-                {
-                    received_cmd = EXT_READ_AT_D2;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == '3')
-                {
-                    received_cmd = EXT_READ_AT_D3;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == '4')
-                {
-                    received_cmd = EXT_READ_AT_D4;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == '5')
-                {
-                    received_cmd = EXT_READ_AT_D5;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-                else if (input_data[15] == '6')
-                {
-                    received_cmd = EXT_READ_AT_D6;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == '7')
-                {
-                    received_cmd = EXT_READ_AT_D7;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-                else if (input_data[15] == '8')
-                {
-                    received_cmd = EXT_READ_AT_D8;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-                else if (input_data[15] == '9')
-                {
-                    received_cmd = EXT_READ_AT_D9;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-                else if (input_data[15] == 'B')
-                {
-                    received_cmd = EXT_READ_AT_DB;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 50;
-                } 
-                else if (input_data[15] == 'D')
-                {
-                    received_cmd = EXT_READ_AT_DD;  //TODO
-                    read_cmd_reply_size = 4;
-                    read_cmd_reply[0] = 0;
-                    read_cmd_reply[1] = 0;
-                    read_cmd_reply[2] = 0;
-                    read_cmd_reply[3] = 1;
-                }
-                else if (input_data[15] == 'E')
-                {
-                    received_cmd = EXT_READ_AT_DE;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0xE8;
-                }
-                else if (input_data[15] == 'H')
-                {
-                    received_cmd = EXT_READ_AT_DH;
-                    read_cmd_reply_size = 4;
-                    read_cmd_reply[0] = 0;
-                    read_cmd_reply[1] = 0;
-                    read_cmd_reply[2] = 0;
-                    read_cmd_reply[3] = 0;
-                }
-                else if (input_data[15] == 'L')
-                {
-                    received_cmd = EXT_READ_AT_DL;
-                    read_cmd_reply_size = 4;
-                    read_cmd_reply[0] = 0;
-                    read_cmd_reply[1] = 0;
-                    read_cmd_reply[2] = 0;
-                    read_cmd_reply[3] = 0;
-                }                
-            }
-            else if (input_data[14] == 'E')
-            {
-                if (input_data[15] == 'A')
-                {
-                    received_cmd = EXT_READ_AT_EA;  //TODO
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0;
-                    read_cmd_reply[1] = 1;
-                }
-                else if (input_data[15] == 'E')
-                {
-                    received_cmd = EXT_READ_AT_EE;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-                else if (input_data[15] == 'O')
-                {
-                    received_cmd = EXT_READ_AT_EO;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-            }
-            else if (input_data[14] == 'G')
-            {
-                if (input_data[15] == 'T')
-                {
-                    received_cmd = EXT_READ_AT_GT;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0x03;
-                    read_cmd_reply[1] = 0xE8;
-                }
-            }
-            else if (input_data[14] == 'H')
-            {
-                if (input_data[15] == 'V')
-                {
-                    received_cmd = EXT_READ_AT_HV;  //TODO
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0x00;
-                    read_cmd_reply[1] = 0x01;
-                }
-            }
-            else if (input_data[14] == 'I')
-            {
-                if (input_data[15] == 'C')
-                {
-                    received_cmd = EXT_READ_AT_IC;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0;
-                    read_cmd_reply[1] = 0;
-                }
-                else if (input_data[15] == 'D')
-                {
-                    received_cmd = EXT_READ_AT_ID; //TODO
-                    read_cmd_reply_size = 8;
-                    read_cmd_reply[0] = 0x00;
-                    read_cmd_reply[1] = 0x00;
-                    read_cmd_reply[2] = 0x00;
-                    read_cmd_reply[3] = 0x00;
-                    read_cmd_reply[4] = 0x00;
-                    read_cmd_reply[5] = 0x00;
-                    read_cmd_reply[6] = 0x00;
-                    read_cmd_reply[7] = 0x00;
-                }
-                else if (input_data[15] == 'I')
-                {
-                    received_cmd = EXT_READ_AT_II;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0xFF;
-                    read_cmd_reply[1] = 0xFF;
-                }
-                else if (input_data[15] == 'R')
-                {
-                    received_cmd = EXT_READ_AT_IR;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0;
-                    read_cmd_reply[1] = 0;
-                }
-            }                
-            else if (input_data[14] == 'J')
-            {
-                if (input_data[15] == 'N')
-                {
-                    received_cmd = EXT_READ_AT_JN;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == 'V')
-                {
-                    received_cmd = EXT_READ_AT_JV;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-            } 
-            else if (input_data[14] == 'K')
-            {
-                if (input_data[15] == 'Y')
-                {
-                    received_cmd = EXT_READ_AT_KY;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-            }
-            else if (input_data[14] == 'L')
-            {
-                if (input_data[15] == 'T')
-                {
-                    received_cmd = EXT_READ_AT_LT;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-            }            
-            else if (input_data[14] == 'M')
-            {
-                if (input_data[15] == 'P')
-                {
-                    received_cmd = EXT_READ_AT_MP;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0xFF;
-                    read_cmd_reply[1] = 0xFE;
-                }
-                else if (input_data[15] == 'Y')
-                {
-                    received_cmd = EXT_READ_AT_MY;
-                    read_cmd_reply_size = 2;
-                    uitemp = (uint16_t)zb_get_short_address();
-                    read_cmd_reply[0] = (uint8_t)(uitemp >> 8);
-                    read_cmd_reply[1] = (uint8_t)uitemp;
-                }
-            }
-            else if (input_data[14] == 'N')
-            {
-                if (input_data[15] == 'B')
-                {
-                    received_cmd = EXT_READ_AT_NB;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == 'C')
-                {
-                    received_cmd = EXT_READ_AT_NC;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 20;
-                }
-                else if (input_data[15] == 'H')
-                {
-                    received_cmd = EXT_READ_AT_NH;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 30;
-                }
-                else if (input_data[15] == 'I')
-                {
-                    received_cmd = EXT_READ_AT_NI; 
-                    read_cmd_reply_size = zb_conf_get_extended_node_identifier(&read_cmd_reply[0]);
-                    if (read_cmd_reply_size == 0)
-                    {
-                        read_cmd_reply_size = 1;
-                        read_cmd_reply[0] = ' ';
-                    }
-                }
-                else if (input_data[15] == 'J')
-                {
-                    received_cmd = EXT_READ_AT_NJ;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 255;
-                }
-                else if (input_data[15] == 'K')
-                {
-                    received_cmd = EXT_READ_AT_NK;
-                    read_cmd_reply_size = 16;
-                    for (i = 0; i < 16; i++) read_cmd_reply[i] = 0;
-                }
-                else if (input_data[15] == 'P')
-                {
-                    received_cmd = EXT_READ_AT_NP;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 255;
-                }
-                else if (input_data[15] == 'T')
-                {
-                    received_cmd = EXT_READ_AT_NT;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 60;
-                }
-                else if (input_data[15] == 'W')
-                {
-                    received_cmd = EXT_READ_AT_NW;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0;
-                    read_cmd_reply[1] = 10;
-                }
-            }
-            else if (input_data[14] == 'O')
-            {
-                if (input_data[15] == 'I')
-                {
-                    received_cmd = EXT_READ_AT_OI;  // TODO
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0x00;
-                    read_cmd_reply[1] = 0x01;
-                }
-                else if (input_data[15] == 'P')
-                {
-                    received_cmd = EXT_READ_AT_OP;  // TODO
-                    read_cmd_reply_size = 8;
-                    read_cmd_reply[0] = 0x00;
-                    read_cmd_reply[1] = 0x00;
-                    read_cmd_reply[2] = 0x00;
-                    read_cmd_reply[3] = 0x00;
-                    read_cmd_reply[4] = 0x00;
-                    read_cmd_reply[5] = 0x00;
-                    read_cmd_reply[6] = 0x00;
-                    read_cmd_reply[7] = 0x01;
-                }
-            }
-            else if (input_data[14] == 'P')
-            {
-                if (input_data[15] == '2')
-                {
-                    received_cmd = EXT_READ_AT_P2;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == '3')
-                {
-                    received_cmd = EXT_READ_AT_P3;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-                else if (input_data[15] == '4')
-                {
-                    received_cmd = EXT_READ_AT_P4;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-                else if (input_data[15] == '5')
-                {
-                    received_cmd = EXT_READ_AT_P5;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-                else if (input_data[15] == '6')
-                {
-                    received_cmd = EXT_READ_AT_P6;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-                else if (input_data[15] == '7')
-                {
-                    received_cmd = EXT_READ_AT_P7;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-                else if (input_data[15] == '8')
-                {
-                    received_cmd = EXT_READ_AT_P8;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-                else if (input_data[15] == '9')
-                {
-                    received_cmd = EXT_READ_AT_P9;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 1;
-                }
-                else if (input_data[15] == 'D')
-                {
-                    received_cmd = EXT_READ_AT_PD;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0x00;
-                    read_cmd_reply[1] = 0x00;
-                    read_cmd_reply[2] = 0xE7;
-                    read_cmd_reply[3] = 0xFF;
-                }
-                else if (input_data[15] == 'L')
-                {
-                    received_cmd = EXT_READ_AT_PL;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 4;
-                }
-                else if (input_data[15] == 'O')
-                {
-                    received_cmd = EXT_READ_AT_PO;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == 'P')
-                {
-                    received_cmd = EXT_READ_AT_PP;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 8;
-                }
-                else if (input_data[15] == 'R')
-                {
-                    received_cmd = EXT_READ_AT_PR;
-                    read_cmd_reply_size = 4;
-                    read_cmd_reply[0] = 0x00;
-                    read_cmd_reply[1] = 0x00;
-                    read_cmd_reply[2] = 0xE7;
-                    read_cmd_reply[3] = 0xFF;
-                }
-            }
-            else if (input_data[14] == 'R')
-            {
-                if (input_data[15] == 'O')
-                {
-                    received_cmd = EXT_READ_AT_RO;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 3;
-                }
-            }
-            else if (input_data[14] == 'S')
-            {
-                if (input_data[15] == 'B')
-                {
-                    received_cmd = EXT_READ_AT_SB;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == 'C')
-                {
-                    received_cmd = EXT_READ_AT_SC;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0x07;
-                    read_cmd_reply[1] = 0xFF;
-                }
-                else if (input_data[15] == 'D')
-                {
-                    received_cmd = EXT_READ_AT_SD;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 3;
-                }
-                else if (input_data[15] == 'E')
-                {
-                    received_cmd = EXT_READ_AT_SE;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0xE8;
-                }
-                else if (input_data[15] == 'M')
-                {
-                    received_cmd = EXT_READ_AT_SM;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == 'N')
-                {
-                    received_cmd = EXT_READ_AT_SN;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0;
-                    read_cmd_reply[1] = 1;
-                }
-                else if (input_data[15] == 'O')
-                {
-                    received_cmd = EXT_READ_AT_SO;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 0;
-                }
-                else if (input_data[15] == 'P')
-                {
-                    received_cmd = EXT_READ_AT_SP;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0;
-                    read_cmd_reply[1] = 32;
-                }
-                else if (input_data[15] == 'T')
-                {
-                    received_cmd = EXT_READ_AT_ST;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 13;
-                    read_cmd_reply[1] = 88;
-                }
-            }
-            else if (input_data[14] == 'T')
-            {
-                if (input_data[15] == 'P')
-                {
-                    received_cmd = EXT_READ_AT_TP;  //TODO
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0x00;
-                    read_cmd_reply[1] = 0x16;
-                }
-            }
-            else if (input_data[14] == 'V')
-            {
-                if (input_data[15] == '+')
-                {
-                    received_cmd = EXT_READ_AT_Vplus;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0;
-                    read_cmd_reply[1] = 0;
-                }
-                else if (input_data[15] == 'R')
-                {
-                    received_cmd = EXT_READ_AT_VR;  //TODO
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0x00;
-                    read_cmd_reply[1] = 0x01;
-                }
-            }
-            else if (input_data[14] == 'W')
+            const wireless_at_read_cmd_entry_t *entry = digi_wireless_find_read_at_cmd(WIRELESS_AT_KEY(input_data[14], input_data[15]));
+            if (entry != NULL)
             {
-                if (input_data[15] == 'H')
-                {
-                    received_cmd = EXT_READ_AT_WH;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0;
-                    read_cmd_reply[1] = 0;
-                }
-            }
-            else if (input_data[14] == 'Z')
-            {
-                if (input_data[15] == 'S')
+                wireless_at_read_request_t request;
+
+                if (entry->getter != NULL)
                 {
-                    received_cmd = EXT_READ_AT_ZS;
-                    read_cmd_reply_size = 1;
-                    read_cmd_reply[0] = 2;
+                    request.reply_size = entry->getter(request.reply);
                 }
-            }
-            else if (input_data[14] == '%')
-            {
-                if (input_data[15] == 'V')
+                else
                 {
-                    received_cmd = EXT_READ_AT_percV;
-                    read_cmd_reply_size = 2;
-                    read_cmd_reply[0] = 0x0C;
-                    read_cmd_reply[1] = 0xE4;
+                    request.reply_size = entry->reply_size;
+                    memcpy(request.reply, entry->reply, entry->reply_size);
                 }
-            }
-            if (received_cmd != NO_SUPPORTED_EXT_READ_AT_CMD)
-            {
+                request.command = entry->command;
+                request.sequence_number = input_data[3];
+                request.first_char = input_data[14];
+                request.second_char = input_data[15];
+
                 b_return = true;
-                read_cmd = received_cmd;
-                read_cmd_sequence_number = input_data[3];
-                read_cmd_first_char = input_data[14];
-                read_cmd_second_char = input_data[15];
-                b_pending_read_cmd = true;
+                if (k_msgq_put(&wireless_read_request_queue, &request, K_NO_WAIT) != 0) atomic_inc(&wireless_requests_dropped_counter);
             }
         }
     }
     return b_return;
 }
 
-/**@brief This function checks if there is a read AT command received through Zigbee pending to be replied, and, in that case
- *        schedules the function that will reply to that command.
+/**@brief This function checks if there are read AT or ping commands received through Zigbee pending to be replied,
+ *        and, in that case, places their replies in the APS output frame queue.
  *
- * @retval True If the transmission of a reply to a read AT command has been scheduled
- * @retval False Otherwise
+ * @note Executed in the main loop.
  */
 void digi_wireless_read_at_command_manager(void)
 {
-    if (b_pending_ping_cmd)
+    static atomic_val_t requests_dropped_reported = 0;
+    wireless_ping_request_t ping_request;
+    wireless_at_read_request_t read_request;
+
+    while (k_msgq_get(&wireless_ping_request_queue, &ping_request, K_NO_WAIT) == 0)
     {
-        b_pending_ping_cmd = false;
-        digi_wireless_ping_reply();        
+        digi_wireless_ping_reply(&ping_request);
     }
-    if (b_pending_read_cmd)
+    while (k_msgq_get(&wireless_read_request_queue, &read_request, K_NO_WAIT) == 0)
     {
-        b_pending_read_cmd = false;
-        digi_wireless_read_at_cmd_reply();
+        digi_wireless_read_at_cmd_reply(&read_request);
+    }
+
+    atomic_val_t requests_dropped = atomic_get(&wireless_requests_dropped_counter);
+    if (requests_dropped != requests_dropped_reported)
+    {
+        requests_dropped_reported = requests_dropped;
+        LOG_WRN("Wireless requests dropped, queue full. Total %d", (int)requests_dropped);
     }
 }
 
 /**@brief This function places in the APS output frame queue the reply to a read AT command received through Zigbee.
 *
+* @param[in]   request   Command pending to be replied, with its reply
 */
-bool digi_wireless_read_at_cmd_reply(void)
+bool digi_wireless_read_at_cmd_reply(const wireless_at_read_request_t *request)
 {
     bool b_return = false;
-    if (read_cmd >= NUMBER_OF_WIRELESS_AT_READ_COMMANDS)
+    if (request->command >= NUMBER_OF_WIRELESS_AT_READ_COMMANDS)
     {
         LOG_ERR("Not supported command");
         return b_return;
     }
-    if ((read_cmd_reply_size < 1) || (read_cmd_reply_size > MAX_SIZE_AT_COMMAND_REPLY))
+    if ((request->reply_size < 1) || (request->reply_size > MAX_SIZE_AT_COMMAND_REPLY))
     {
         LOG_ERR("Size of reply out of range");
         return b_return;
     }
 
-    if( zigbee_aps_get_output_frame_buffer_free_space() )
+    aps_output_frame_t *element = zigbee_aps_reserve_frame(APS_PRIORITY_CONTROL); // Built in place in the queue
+
+    if( element != NULL )
     {
         uint8_t i;
-        aps_output_frame_t element;
 
-        element.dst_addr.addr_short = COORDINATOR_SHORT_ADDRESS;
-        element.cluster_id = DIGI_AT_COMMAND_REPLY_CLUSTER;
-        element.src_endpoint = DIGI_AT_COMMAND_SOURCE_ENDPOINT;
-        element.dst_endpoint = DIGI_AT_COMMAND_DESTINATION_ENDPOINT;
+        element->dst_addr.addr_short = COORDINATOR_SHORT_ADDRESS;
+        element->cluster_id = DIGI_AT_COMMAND_REPLY_CLUSTER;
+        element->src_endpoint = DIGI_AT_COMMAND_SOURCE_ENDPOINT;
+        element->dst_endpoint = DIGI_AT_COMMAND_DESTINATION_ENDPOINT;
+        element->status_cb = digi_wireless_reply_status_cb;
         i = 0;
-        element.payload[i++] = read_cmd_sequence_number;
-        element.payload[i++] = read_cmd_first_char; 
-        element.payload[i++] = read_cmd_second_char;
-        element.payload[i++] = 0;
-        for (uint8_t j=0; j<read_cmd_reply_size; j++)
+        element->payload[i++] = request->sequence_number;
+        element->payload[i++] = request->first_char;
+        element->payload[i++] = request->second_char;
+        element->payload[i++] = 0;
+        for (uint8_t j=0; j<request->reply_size; j++)
         {
-            element.payload[i++] = read_cmd_reply[j];
+            element->payload[i++] = request->reply[j];
         }
-        element.payload_size = (zb_uint8_t)i;
-        LOG_WRN("Wireless AT command reply");
-        if( enqueue_aps_frame(&element) ) b_return = true;
+        element->payload_size = (zb_uint8_t)i;
+        PACKET_LOG_DBG("Wireless AT command reply");
+        if( zigbee_aps_commit_frame(APS_PRIORITY_CONTROL) ) b_return = true;
     }
 
     if( !b_return ) LOG_ERR("Not free space of aps output frame queue");
@@ -760,28 +349,45 @@ bool digi_wireless_read_at_cmd_reply(void)
     return b_return;
 }
 
+/**@brief Executed when the transmission of a reply to a wireless AT or ping command has finished.
+ *        Replies that were not delivered are counted; the coordinator repeats the command.
+ *
+ * @note Executed in the Zigbee thread.
+ */
+void digi_wireless_reply_status_cb(zb_uint16_t handle, zb_ret_t status, uint32_t latency_ms)
+{
+    if( status != RET_OK )
+    {
+        wireless_replies_not_delivered_counter++;
+        LOG_WRN("Wireless reply %d not delivered (status %d). Total not delivered %d", handle, status, wireless_replies_not_delivered_counter);
+    }
+}
+
 /**@brief This function places in the APS output frame queue the reply to a ping command received through Zigbee.
 *
+* @param[in]   request   Command pending to be replied
 */
-bool digi_wireless_ping_reply(void)
+bool digi_wireless_ping_reply(const wireless_ping_request_t *request)
 {
     bool b_return = false;
 
-    if( zigbee_aps_get_output_frame_buffer_free_space() )
+    aps_output_frame_t *element = zigbee_aps_reserve_frame(APS_PRIORITY_CONTROL); // Built in place in the queue
+
+    if( element != NULL )
     {
         uint8_t i;
-        aps_output_frame_t element;
 
-        element.dst_addr.addr_short = COORDINATOR_SHORT_ADDRESS;
-        element.cluster_id = DIGI_AT_PONG_CLUSTER;
-        element.src_endpoint = DIGI_AT_PONG_SOURCE_ENDPOINT;
-        element.dst_endpoint = DIGI_AT_PONG_DESTINATION_ENDPOINT;
+        element->dst_addr.addr_short = COORDINATOR_SHORT_ADDRESS;
+        element->cluster_id = DIGI_AT_PONG_CLUSTER;
+        element->src_endpoint = DIGI_AT_PONG_SOURCE_ENDPOINT;
+        element->dst_endpoint = DIGI_AT_PONG_DESTINATION_ENDPOINT;
+        element->status_cb = digi_wireless_reply_status_cb;
         i = 0;
-        element.payload[i++] = ping_first_char;
-        element.payload[i++] = ping_second_char; 
-        element.payload_size = (zb_uint8_t)i;
-        LOG_WRN("Ping command reply");
-        if( enqueue_aps_frame(&element) ) b_return = true;
+        element->payload[i++] = request->first_char;
+        element->payload[i++] = request->second_char;
+        element->payload_size = (zb_uint8_t)i;
+        PACKET_LOG_DBG("Ping command reply");
+        if( zigbee_aps_commit_frame(APS_PRIORITY_CONTROL) ) b_return = true;
     }
 
     if( !b_return ) LOG_ERR("Not free space of aps output frame queue");
@@ -8,7 +8,12 @@
 
 #include "global_defines.h"
 
-#define MAX_SIZE_AT_COMMAND_REPLY MAXIMUM_SIZE_NODE_IDENTIFIER
+#define MAX_SIZE_AT_COMMAND_REPLY (MAXIMUM_SIZE_NODE_IDENTIFIER + 1) // The NI getter also writes the '\0'
+#define MAX_SIZE_AT_COMMAND_CONSTANT_REPLY 8 // Bigger replies are built by a getter
+#define WIRELESS_REQUEST_QUEUE_SIZE 4 // Requests handed over from the APS rx work queue to the main loop
+
+/* Key of the table of read AT commands, made of the two characters of the command */
+#define WIRELESS_AT_KEY(first_char, second_char) ( ( (uint16_t)(first_char) << 8 ) | (uint8_t)(second_char) )
 
 /* Enumerative with the supported Xbee wireless AT commands used to read parameters */
 enum wireless_at_read_cmd_e{
@@ -96,18 +101,42 @@ enum wireless_at_read_cmd_e{
     NO_SUPPORTED_EXT_READ_AT_CMD
 };
 
+/* Builds the reply to a read AT command whose value is not constant. Returns the size of the reply */
+typedef uint8_t (*wireless_at_read_getter_t)(uint8_t *reply);
+
+/* Entry of the table of supported read AT commands */
+typedef struct {
+    uint16_t key;                     // WIRELESS_AT_KEY of the command
+    uint8_t command;                  // enum wireless_at_read_cmd_e
+    uint8_t reply_size;               // Size of the constant reply, not used with a getter
+    wireless_at_read_getter_t getter; // NULL if the reply is constant
+    uint8_t reply[MAX_SIZE_AT_COMMAND_CONSTANT_REPLY]; // Constant reply
+} wireless_at_read_cmd_entry_t;
+
+/* Read AT command pending to be replied, with its reply already built */
+typedef struct {
+    uint8_t command;         // enum wireless_at_read_cmd_e
+    uint8_t first_char;
+    uint8_t second_char;
+    uint8_t sequence_number;
+    uint8_t reply_size;
+    uint8_t reply[MAX_SIZE_AT_COMMAND_REPLY];
+} wireless_at_read_request_t;
+
+/* Ping command pending to be replied */
+typedef struct {
+    uint8_t first_char;
+    uint8_t second_char;
+} wireless_ping_request_t;
+
 void digi_wireless_at_init(void);
+void digi_wireless_at_command_rx_handler(const zb_apsde_data_indication_t *ind, zb_uint8_t *payload, zb_uint16_t payload_size);
+void digi_wireless_ping_rx_handler(const zb_apsde_data_indication_t *ind, zb_uint8_t *payload, zb_uint16_t payload_size);
 bool is_a_ping_command(uint8_t* input_data, int16_t size_of_input_data);
 bool is_a_digi_read_at_command(uint8_t* input_data, int16_t size_of_input_data);
 void digi_wireless_read_at_command_manager(void);
-bool digi_wireless_read_at_cmd_reply(void);
-bool digi_wireless_ping_reply(void);
+bool digi_wireless_read_at_cmd_reply(const wireless_at_read_request_t *request);
+bool digi_wireless_ping_reply(const wireless_ping_request_t *request);
+void digi_wireless_reply_status_cb(zb_uint16_t handle, zb_ret_t status, uint32_t latency_ms);
 
 #endif /* DIGI_WIRELESS_AT_COMMANDS_H_ */
-
-
-
-
-
-
-
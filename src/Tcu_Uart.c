@@ -19,6 +19,14 @@
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/drivers/uart.h>
 #include <string.h>
+#ifdef CONFIG_TCU_UART_ISR_STATS
+#include <zephyr/timing/timing.h>
+#if !defined(CONFIG_TCU_UART_ASYNC)
+#include <nrfx_timer.h>
+#include <helpers/nrfx_gppi.h>
+#include <hal/nrf_uarte.h>
+#endif
+#endif
 
 #include "Digi_profile.h"
 #include "zigbee_aps.h"
@@ -26,47 +34,174 @@
 
 #include "tcu_Uart.h"
 
-#define MAX_QUEUE_SIZE 10
 #define MAX_MESSAGE_SIZE 256
 #define UART_CHUNK_SIZE 8
 
-typedef struct{
-    uint8_t buffer[MAX_MESSAGE_SIZE];
-    uint16_t size;  // Keep track of the size
-}tcu_message;
-
-K_MSGQ_DEFINE(tcu_uart_tx_message_queue, sizeof(tcu_message), MAX_QUEUE_SIZE, 4);  // Align buffer to 4 bytes
+/* Downlink messages are queued in a byte ring as records: length followed by the payload. Each
+ * message only uses the RAM it needs, so dozens of short Modbus requests fit in the ring */
+typedef uint16_t tcu_message_length_t;
+
+RING_BUF_DECLARE(tcu_uart_tx_ring, TCU_UART_TX_RING_SIZE);
+static uint32_t tcu_uart_tx_ring_high_water_mark = 0; // Maximum number of bytes used in the ring
+
+/* The coordinator rebuilds the fragmented frames with the sizes of Digi_profile.h */
+BUILD_ASSERT(APS_UNENCRYPTED_PAYLOAD_MAX == DIGI_UNENCRYPTED_PAYLOAD_MAX,
+             "The uplink frames must match the format expected by the coordinator");
+
+#ifdef CONFIG_TCU_UART_UPLINK_AGGREGATION
+/* Uplink frames are packed as records (length byte + frame) in a slot of the APS output queue,
+ * reserved and built in place until it is queued for transmission */
+#define TCU_UART_AGGREGATION_RECORD_MAX (APS_UNENCRYPTED_PAYLOAD_MAX - 1) // Biggest frame that can be aggregated
+
+static aps_output_frame_t *tcu_uart_aggregated_frame = NULL; // NULL if no frame is being aggregated
+static uint32_t tcu_uart_aggregated_frame_start_ms;           // Time when its first record was added
+static uint8_t tcu_uart_aggregated_records;                   // TCU frames aggregated in it
+static uint16_t tcu_uart_aggregated_bytes;                    // TCU payload of its records
+static uint32_t tcu_uart_aggregated_time_sum_ms;              // Sum of the times its records were added
+#endif
+
+/* TCU frames sent uplink whose APS frames have not all completed. The transmission status of the
+ * APS frames (Zigbee thread) is matched by handle: the APS frames of one TCU frame are committed
+ * one after the other by the main loop, so their handles are consecutive */
+typedef struct {
+    zb_uint16_t first_handle;
+    zb_uint16_t last_handle;
+    uint8_t aps_frames_pending;   // 0 if the entry is free
+    bool b_failed;
+    uint8_t tcu_frames;           // More than one if they were aggregated
+    uint16_t tcu_bytes;
+    uint32_t enqueue_time_first_ms;
+    uint32_t enqueue_time_sum_ms; // Sum of the enqueue times of the TCU frames (modulo 2^32)
+} tcu_uart_uplink_frame_t;
+
+#define TCU_UART_UPLINK_TRACKED_FRAMES ( APS_DATA_FRAME_BUFFER_SIZE + APS_TX_WINDOW_SIZE ) // Each one has APS frames queued or in flight
+
+static tcu_uart_uplink_frame_t tcu_uart_uplink_frames[TCU_UART_UPLINK_TRACKED_FRAMES];
+static uint8_t tcu_uart_uplink_frames_in_flight = 0;
+static uint32_t tcu_uart_uplink_busy_start_ms;
+static tcu_uart_uplink_statistics_t tcu_uart_uplink_statistics;
+static struct k_spinlock tcu_uart_uplink_lock; // The status of the APS frames is reported in the Zigbee thread
+
+static uint8_t tcu_uart_fragment_message_id = 0; // Identifies the fragments of the same uplink frame
+
+#ifdef CONFIG_TCU_UART_ISR_STATS
+/* Measured with the timing functions (cycle counter) and written only in interrupt context */
+static uint32_t tcu_uart_isr_overruns = 0;
+static uint64_t tcu_uart_isr_max_duration_cycles = 0;
+#if !defined(CONFIG_TCU_UART_ASYNC)
+/* RX latency: the RXDRDY event of the UARTE is captured by TIMER1 (CC0) through a (G)PPI channel,
+ * and the entry of the ISR by software (CC1). The channel disables itself through its group, so only
+ * the first byte received after the channel has been armed is timestamped */
+#define TCU_UART_ISR_LATENCY_TIMER_FREQ_HZ 16000000
+#define TCU_UART_ISR_LATENCY_NOT_CAPTURED  UINT32_MAX // Written in CC0 when the channel is armed
+static const nrfx_timer_t tcu_uart_isr_latency_timer = NRFX_TIMER_INSTANCE(1);
+/* The 802.15.4 radio driver and MPSL declare the TIMER instances they own in NRFX_TIMERS_USED */
+BUILD_ASSERT((NRFX_TIMERS_USED & BIT(1)) == 0, "TIMER1 is reserved by the radio stack, the RX latency can not use it");
+static nrfx_gppi_channel_group_t tcu_uart_isr_latency_group;
+static bool b_tcu_uart_isr_latency_ready = false;
+static uint32_t tcu_uart_isr_max_rx_latency_ticks = 0; // TIMER1 ticks
+static uint32_t tcu_uart_isr_rx_latency_samples = 0;
+#endif
+#endif
 
 extern uint16_t tcu_uart_frames_received_counter;
+extern uint16_t tcu_uart_frames_transmitted_counter;
+extern uint16_t aps_frames_received_binary_cluster_counter;
+extern uint16_t tcu_uart_frames_not_delivered_counter;
 
 LOG_MODULE_REGISTER(uart_app, LOG_LEVEL_DBG);
 
 /* Local variables used to manage the command mode of the zigbee module */
 static volatile bool b_zigbee_module_in_command_mode = false;
-static volatile uint8_t enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_INITIAL_SILENCE_ST;
-static volatile uint16_t pre_silence_timer_ms = 0;
-static volatile uint16_t post_silence_timer_ms = 0;
-static volatile uint16_t leave_cmd_mode_silence_timer_ms = 0;
+static volatile uint8_t enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_FIRST_CHAR_ST;
 /**/
 
-static volatile tcu_message tcu_transmission_buffer = {0};
-static volatile uint8_t tcu_transmission_buffer_index = 0;
+/* Command mode processing ("+++" detection and AT commands) is deferred to a dedicated work queue.
+ * The ISR only timestamps and stores the bytes relevant to it as RX events */
+typedef struct{
+    int64_t timestamp_ticks;   // System uptime [ticks] when the burst containing the byte was received
+    uint32_t silence_us;       // Silence in the line before the byte [us]
+    uint8_t byte;
+}tcu_uart_rx_event_t;
+
+K_MSGQ_DEFINE(tcu_uart_rx_event_queue, sizeof(tcu_uart_rx_event_t), TCU_UART_RX_EVENT_QUEUE_SIZE, 4);
+K_THREAD_STACK_DEFINE(tcu_uart_cmd_work_q_stack, TCU_UART_CMD_WORK_Q_STACK_SIZE);
+static struct k_work_q tcu_uart_cmd_work_q;
+
+static void tcu_uart_rx_event_work_handler(struct k_work *work);
+static void tcu_uart_guard_time_work_handler(struct k_work *work);
+static void tcu_uart_cmd_mode_timeout_work_handler(struct k_work *work);
+static void tcu_uart_binary_value_rx_handler(const zb_apsde_data_indication_t *ind, zb_uint8_t *payload, zb_uint16_t payload_size);
+K_WORK_DEFINE(tcu_uart_rx_event_work, tcu_uart_rx_event_work_handler);
+K_WORK_DELAYABLE_DEFINE(tcu_uart_guard_time_work, tcu_uart_guard_time_work_handler);
+K_WORK_DELAYABLE_DEFINE(tcu_uart_cmd_mode_timeout_work, tcu_uart_cmd_mode_timeout_work_handler);
+
+/* Every RX burst is tagged with the 64 bit system uptime in ticks. Frame gaps, guard times and the
+ * command mode timeout are measured from these timestamps, which do not wrap after a long silence */
+static struct k_spinlock tcu_uart_rx_lock;
+static int64_t tcu_uart_last_rx_ticks = 0; // Uptime when the last byte was received (ISR, protected by tcu_uart_rx_lock)
+static bool b_tcu_uart_last_rx_byte_was_plus = false; // (ISR)
+static uint32_t tcu_uart_rx_events_dropped = 0; // Bytes not stored because the RX event queue was full (ISR)
+static uint32_t tcu_uart_rx_frames_discarded_ring_full = 0; // Frames lost because all the RX frame slots were pending (ISR)
+static uint32_t tcu_uart_rx_frames_discarded_overflow = 0;  // Frames lost because they did not fit in an RX frame slot (ISR)
+static uint32_t tcu_uart_downlink_frames_discarded = 0; // Downlink frames not sent in command mode or too short (APS rx work queue)
+
+/* AT command being received in command mode (work queue) */
+static uint8_t tcu_uart_at_command_buffer[UART_RX_BUFFER_SIZE];
+static uint16_t tcu_uart_at_command_index = 0;
+static bool b_tcu_uart_at_command_overflow = false;
+
+static uint8_t *volatile tcu_transmission_chunk = NULL;     // Contiguous part of the message being transmitted, claimed from the ring
+static volatile uint16_t tcu_transmission_chunk_size = 0;
+static volatile uint16_t tcu_transmission_pending_size = 0; // Bytes of the message not claimed yet (it wraps around the end of the ring)
+static volatile uint16_t tcu_transmission_buffer_index = 0;
 bool    tcu_transmission_running = false;
 
-static volatile uint8_t tcu_uart_rx_buffer[UART_RX_BUFFER_SIZE] = {0};
+/* Ring of frames received from the TCU. The ISR fills the slot pointed by head; completed
+ * frames stay between tail and head until the main loop has placed them in the APS queue. */
+typedef struct{
+    uint8_t data[UART_RX_BUFFER_SIZE];
+    uint16_t size;
+}tcu_uart_rx_frame_t;
+
+static tcu_uart_rx_frame_t tcu_uart_rx_frames[TCU_UART_RX_FRAME_SLOTS];
+static volatile uint8_t tcu_uart_rx_frames_head = 0; // Slot being filled by the ISR (written only by the ISR)
+static volatile uint8_t tcu_uart_rx_frames_tail = 0; // Oldest completed frame (written only by the main loop)
 static volatile uint16_t tcu_uart_rx_buffer_index = 0;
-static volatile uint16_t tcu_uart_rx_buffer_frame_size = 0;
 static volatile bool b_tcu_uart_rx_buffer_overflow = false;
-static volatile bool b_tcu_uart_rx_buffer_busy = false;
 static volatile bool b_tcu_uart_rx_receiving_frame = false;
-static volatile bool b_tcu_uart_rx_complete_frame_received = false;
-static volatile bool b_tcu_uart_rx_corrupted_frame = false;
-static volatile uint16_t tcu_uart_rx_time_since_last_byte_ms = 0;
 
-// Define a counter variable outside the function
-// Declare variables to store the idle start time and idle duration
-static uint64_t uart_idle_start_time = 0;
-static uint64_t uart_idle_duration = 0;
+/* Modbus RTU character timing, derived from tcu_uart_config by tcu_uart_update_frame_timing() */
+static uint32_t tcu_uart_char_time_us = 0;   // Time needed to transmit one character [us]
+static uint32_t tcu_uart_t35_us = 0;         // Silence that marks the end of a frame (t3.5) [us]
+static uint32_t tcu_uart_end_of_frame_timeout_us = 0; // Timeout of the end of frame timer, started when a chunk is received [us]
+
+#if defined(CONFIG_TCU_UART_ASYNC)
+static uint8_t tcu_uart_async_rx_buffers[TCU_UART_ASYNC_RX_BUFFER_COUNT][TCU_UART_ASYNC_RX_BUFFER_SIZE];
+static uint8_t tcu_uart_async_rx_next_buffer = 0; // Next buffer handed to the driver
+static uint32_t tcu_uart_async_rx_timeout_us = 0;  // Silence after which the driver delivers a partially filled buffer [us]
+
+static int tcu_uart_async_rx_start(void);
+static int tcu_uart_async_tx_start(void);
+static void tcu_uart_async_cb(const struct device *dev, struct uart_event *evt, void *user_data);
+#endif
+
+#if defined(CONFIG_TCU_UART_ISR_STATS) && !defined(CONFIG_TCU_UART_ASYNC)
+static void tcu_uart_isr_latency_init(void);
+#endif
+
+static void tcu_uart_end_of_frame_timer_handler(struct k_timer *timer);
+K_TIMER_DEFINE(tcu_uart_end_of_frame_timer, tcu_uart_end_of_frame_timer_handler, NULL);
+static bool b_tcu_uart_end_of_frame_timer_running = false;
+
+/* TX pacing: after a transmission the line must stay silent during the inter-frame gap before the
+ * next queued message is started. tcu_uart_tx_lock protects the transmission state. */
+static struct k_spinlock tcu_uart_tx_lock;
+static volatile bool b_tcu_uart_tx_gap_running = false;
+static uint32_t tcu_uart_tx_gap_us = 0; // Inter-frame gap, derived from t3.5 [us]
+
+static void tcu_uart_tx_gap_timer_handler(struct k_timer *timer);
+K_TIMER_DEFINE(tcu_uart_tx_gap_timer, tcu_uart_tx_gap_timer_handler, NULL);
 
 /* Get the device pointer of the UART hardware */
 static const struct device *dev_tcu_uart= DEVICE_DT_GET(DT_NODELABEL(uart0));
@@ -89,25 +224,61 @@ static struct uart_config tcu_uart_config = {
  */
 int8_t tcu_uart_init(void)
 {
-    int8_t ret = tcu_uart_configuration();
+    static const struct k_work_queue_config tcu_uart_cmd_work_q_config = { .name = "tcu_uart_cmd" };
+
+    k_work_queue_start(&tcu_uart_cmd_work_q, tcu_uart_cmd_work_q_stack, K_THREAD_STACK_SIZEOF(tcu_uart_cmd_work_q_stack),
+                       TCU_UART_CMD_WORK_Q_PRIORITY, &tcu_uart_cmd_work_q_config);
+
     b_zigbee_module_in_command_mode = false;
+    tcu_uart_rx_frames_head = 0;
+    tcu_uart_rx_frames_tail = 0;
     tcu_uart_rx_buffer_init();
-    return ret;
+    zigbee_aps_register_rx_handler(DIGI_PROFILE_ID, DIGI_BINARY_VALUE_CLUSTER, DIGI_BINARY_VALUE_SOURCE_ENDPOINT,
+                                   DIGI_BINARY_VALUE_DESTINATION_ENDPOINT, tcu_uart_binary_value_rx_handler);
+#if defined(CONFIG_TCU_UART_ISR_STATS) && !defined(CONFIG_TCU_UART_ASYNC)
+    tcu_uart_isr_latency_init();
+#endif
+    return tcu_uart_configuration();
 }
 
 /**@brief Initialization of the TCU UART RX buffer
  *
+ * @note Frames already completed and pending in the RX frame ring are kept.
+ *       Once the UART interrupt is enabled it has to be called with tcu_uart_rx_lock held.
  */
 void tcu_uart_rx_buffer_init(void)
 {
     tcu_uart_rx_buffer_index = 0;
-    tcu_uart_rx_buffer_frame_size = 0;
     b_tcu_uart_rx_buffer_overflow = false;
-    b_tcu_uart_rx_buffer_busy = false;
     b_tcu_uart_rx_receiving_frame = false;
-    b_tcu_uart_rx_complete_frame_received = false;
-    b_tcu_uart_rx_corrupted_frame = false;
-    tcu_uart_rx_time_since_last_byte_ms = 0;
+}
+
+/**@brief Pointer to the RX frame slot currently being filled by the ISR
+ *
+ */
+static inline uint8_t *tcu_uart_rx_fill_buffer(void)
+{
+    return tcu_uart_rx_frames[tcu_uart_rx_frames_head].data;
+}
+
+/**@brief Close the frame being received and publish it to the main loop.
+ *        Reception continues immediately on the next slot of the ring.
+ *
+ * @note Executed in interrupt context.
+ */
+static void tcu_uart_rx_frame_close(void)
+{
+    uint8_t next_head = tcu_uart_rx_frames_head + 1;
+    if( next_head >= TCU_UART_RX_FRAME_SLOTS ) next_head = 0;
+
+    if( next_head == tcu_uart_rx_frames_tail )
+    {
+        tcu_uart_rx_frames_discarded_ring_full++; // Not logged in interrupt context, reported by the main loop
+        return;
+    }
+    tcu_uart_rx_frames[tcu_uart_rx_frames_head].size = tcu_uart_rx_buffer_index;
+    compiler_barrier(); // Frame contents must be stored before the slot is published
+    tcu_uart_rx_frames_head = next_head;
 }
 
 /**@brief Configuration and initialization of the UART used to communicate with the TCU
@@ -133,6 +304,32 @@ int8_t tcu_uart_configuration(void)
         return -1;
     }
 
+    tcu_uart_update_frame_timing();
+
+#if defined(CONFIG_TCU_UART_ASYNC)
+	/* configure async callback and start reception on the first DMA buffer */
+	int ret = uart_callback_set(dev_tcu_uart, tcu_uart_async_cb, NULL);
+
+	if (ret < 0) {
+		if (ret == -ENOTSUP) {
+			LOG_ERR("Async UART API support not enabled\n");
+		} else if (ret == -ENOSYS) {
+			LOG_ERR("UART device does not support async API\n");
+		} else {
+			LOG_ERR("Error setting UART callback: %d\n", ret);
+		}
+		return -1;
+	}
+
+	tcu_uart_async_rx_next_buffer = 0;
+	ret = tcu_uart_async_rx_start();
+	if (ret < 0) {
+		LOG_ERR("Error enabling UART async reception: %d\n", ret);
+		return -1;
+	}
+	LOG_DBG("UART async configuration successful!\n");
+	return 0;
+#else
 	/* configure interrupt and callback to receive data */
 	int ret = uart_irq_callback_set(dev_tcu_uart, tcu_uart_isr);
 
@@ -153,111 +350,129 @@ int8_t tcu_uart_configuration(void)
 
 	uart_irq_rx_enable(dev_tcu_uart);
     return 0;
+#endif
 }
 
-/**@brief This function updates the timers used in the Tcu UART FW module.
- * @details The 10 ms silence to consider that a RX frame is complete [10ms]
- *        The 0.5 s silence before and after the sequence "+++", which make the Zigbee module
- *        to enter in command mode
- *        The 10 s silence which makes the which make the Zigbee module to exit command mode
+/**@brief Compute the Modbus RTU character time and t3.5 silence from the current
+ *        TCU UART configuration (baud rate, data bits, parity and stop bits).
  *
- * This function should be executed at 10 kHz.
+ * @details Below MODBUS_RTU_FIXED_TIMING_BAUDRATE t3.5 is 3.5 character times. Above it
+ *          the Modbus RTU specification fixes t3.5 to MODBUS_RTU_FIXED_T35_US.
  *
+ * @note It has to be executed every time tcu_uart_config is changed.
  */
-void tcu_uart_timers_10kHz(void)
+void tcu_uart_update_frame_timing(void)
 {
-    static uint8_t one_ms_counter = 0;
+    uint32_t bits_per_char = 1; // Start bit
+
+    switch( tcu_uart_config.data_bits )
+    {
+     case UART_CFG_DATA_BITS_5: bits_per_char += 5; break;
+     case UART_CFG_DATA_BITS_6: bits_per_char += 6; break;
+     case UART_CFG_DATA_BITS_7: bits_per_char += 7; break;
+     case UART_CFG_DATA_BITS_9: bits_per_char += 9; break;
+     default:                   bits_per_char += 8; break;
+    }
+    if( tcu_uart_config.parity != UART_CFG_PARITY_NONE ) bits_per_char += 1;
+    if( ( tcu_uart_config.stop_bits == UART_CFG_STOP_BITS_1_5 ) || ( tcu_uart_config.stop_bits == UART_CFG_STOP_BITS_2 ) ) bits_per_char += 2;
+    else bits_per_char += 1;
+
+    tcu_uart_char_time_us = ( bits_per_char * 1000000UL + tcu_uart_config.baudrate - 1 ) / tcu_uart_config.baudrate;
 
-    if( one_ms_counter < 10 ) one_ms_counter++;
+    if( tcu_uart_config.baudrate > MODBUS_RTU_FIXED_TIMING_BAUDRATE )
+    {
+        tcu_uart_t35_us = MODBUS_RTU_FIXED_T35_US;
+    }
     else
     {
-        one_ms_counter = 0;
-/*      Verify the 10 ms silence needed to consider that the RX frame is complete    */
-        if( !b_zigbee_module_in_command_mode )
-        {
-            if( b_tcu_uart_rx_receiving_frame )
-            {
-                tcu_uart_rx_time_since_last_byte_ms++;
-                if( tcu_uart_rx_time_since_last_byte_ms > TICKS_TO_CONSIDER_FRAME_COMPLETED )
-                {
-                    if( b_tcu_uart_rx_buffer_overflow || b_tcu_uart_rx_corrupted_frame ) // Discard frame if rx buffer overflow or frame corrupted
-                    {
-                        b_tcu_uart_rx_buffer_overflow = false;
-                        b_tcu_uart_rx_corrupted_frame = false;
-                        LOG_ERR("Discarded frame. Buffer overflow or corrupted frame");
-                    }
-                    else
-                    {
-                        b_tcu_uart_rx_complete_frame_received = true;
-                        tcu_uart_rx_buffer_frame_size = tcu_uart_rx_buffer_index;
-                        b_tcu_uart_rx_buffer_busy = true; // Do not accept new characters until received frame is processed
-                    }
-                    b_tcu_uart_rx_receiving_frame = false;
-                    tcu_uart_rx_time_since_last_byte_ms = 0;
-                    tcu_uart_rx_buffer_index = 0;
-                }
-            }
-            else
-            {
-                tcu_uart_rx_time_since_last_byte_ms = 0;
-            }
-        }
-/*      Verify the 500 ms silences needed to accept the "+++" sequence        */
-        if( enter_cmd_mode_sequence_st == ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_INITIAL_SILENCE_ST )
+        tcu_uart_t35_us = ( tcu_uart_char_time_us * 7 + 1 ) / 2; // 3.5 characters, rounded up
+    }
+
+#if defined(CONFIG_TCU_UART_ASYNC)
+    // The driver delivers a chunk after one character of silence. That silence is part of t3.5
+    tcu_uart_async_rx_timeout_us = tcu_uart_char_time_us;
+    tcu_uart_end_of_frame_timeout_us = tcu_uart_t35_us - tcu_uart_async_rx_timeout_us;
+#else
+    tcu_uart_end_of_frame_timeout_us = tcu_uart_t35_us;
+#endif
+    tcu_uart_tx_gap_us = MAX(tcu_uart_t35_us, TCU_UART_TX_MIN_INTER_FRAME_GAP_US);
+    LOG_DBG("TCU UART %d bps: char time %d us, t3.5 %d us", tcu_uart_config.baudrate, tcu_uart_char_time_us, tcu_uart_t35_us);
+}
+
+/**@brief Convert a number of ticks to microseconds, saturated to UINT32_MAX (about 71 minutes)
+ *
+ */
+static inline uint32_t tcu_uart_ticks_to_us(int64_t ticks)
+{
+    return (uint32_t)MIN(k_ticks_to_us_floor64((uint64_t)ticks), (uint64_t)UINT32_MAX);
+}
+
+/**@brief Time elapsed since a timestamp taken with k_uptime_ticks()
+ *
+ * @param[in]   timestamp_ticks   Value of k_uptime_ticks() at the reference instant
+ *
+ * @return Elapsed time [us], saturated to UINT32_MAX
+ */
+static inline uint32_t tcu_uart_us_since(int64_t timestamp_ticks)
+{
+    return tcu_uart_ticks_to_us(k_uptime_ticks() - timestamp_ticks);
+}
+
+/**@brief Expiry function of the end of frame timer. The timer is armed by the first burst of a
+ *        frame; on expiry the silence since the last burst is measured from its timestamp and the
+ *        timer is re-armed with the remaining time until it reaches t3.5: the frame is complete.
+ *
+ * @note Executed in interrupt context.
+ */
+static void tcu_uart_end_of_frame_timer_handler(struct k_timer *timer)
+{
+    k_spinlock_key_t key = k_spin_lock(&tcu_uart_rx_lock);
+    uint32_t silence_us = tcu_uart_us_since(tcu_uart_last_rx_ticks);
+
+    if( !b_zigbee_module_in_command_mode && b_tcu_uart_rx_receiving_frame )
+    {
+        if( silence_us < tcu_uart_end_of_frame_timeout_us )
         {
-            if( pre_silence_timer_ms < 500 ) pre_silence_timer_ms++;
-            else
-            {
-                pre_silence_timer_ms = 0;
-                enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_FIRST_CHAR_ST;
-            }
+            k_timer_start(timer, K_USEC(tcu_uart_end_of_frame_timeout_us - silence_us), K_NO_WAIT);
+            k_spin_unlock(&tcu_uart_rx_lock, key);
+            return;
         }
-        else if( enter_cmd_mode_sequence_st == ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_END_SILENCE_ST )
+
+        if( b_tcu_uart_rx_buffer_overflow ) // Discard frame if rx buffer overflow
         {
-            if( post_silence_timer_ms < 500 ) post_silence_timer_ms++;
-            else
-            {
-                post_silence_timer_ms = 0;
-                switch_tcu_uart_to_command_mode();
-                digi_at_reply_ok();
-                enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_INITIAL_SILENCE_ST;
-            }
+            b_tcu_uart_rx_buffer_overflow = false;
+            tcu_uart_rx_frames_discarded_overflow++;
         }
-/*      Verify the 10 s silence which makes the zigbee module to leave automatically the command mode */
-        if( b_zigbee_module_in_command_mode )
+        else
         {
-            if( leave_cmd_mode_silence_timer_ms < 10000 ) leave_cmd_mode_silence_timer_ms++;
-            else
-            {
-                switch_tcu_uart_out_of_command_mode();
-            }
+            tcu_uart_rx_frame_close();
         }
+        b_tcu_uart_rx_receiving_frame = false;
+        tcu_uart_rx_buffer_index = 0;
     }
+    b_tcu_uart_end_of_frame_timer_running = false;
+
+    k_spin_unlock(&tcu_uart_rx_lock, key);
 }
 
 /**@brief This function processes the last byte received throught the
  *        TCU's UART when the Zigbee module is in command mode
  *
+ * @note Executed in the TCU UART command work queue.
  */
 void tcu_uart_process_byte_received_in_command_mode(uint8_t input_byte)
 {
-    leave_cmd_mode_silence_timer_ms = 0; //Reset the timer every time a character is received
-    check_input_sequence_for_entering_in_command_mode(input_byte); // It also has to be checked when we are already in command mode.
-
     if(input_byte == '\r') // End of frame
     {
-        //LOG_WRN("Received AT command");
-        //LOG_HEXDUMP_DBG(tcu_uart_rx_buffer, tcu_uart_rx_buffer_index, "Received AT command in hex:");
-
-        if( tcu_uart_rx_buffer_index == 0 ) return; //Ignore empty commands
+        if( tcu_uart_at_command_index == 0 ) return; //Ignore empty commands
 
-        if( b_tcu_uart_rx_buffer_overflow )
+        if( b_tcu_uart_at_command_overflow )
         {
             digi_at_reply_error();
         }
         else
         {
-            int8_t command_analysis_result = digi_at_analyze_and_reply_to_command((uint8_t *)tcu_uart_rx_buffer, tcu_uart_rx_buffer_index);
+            int8_t command_analysis_result = digi_at_analyze_and_reply_to_command(tcu_uart_at_command_buffer, tcu_uart_at_command_index);
             if( command_analysis_result == AT_CMD_OK_LEAVE_CMD_MODE ) //As a result of the command, we should leave command mode
             {
                 switch_tcu_uart_out_of_command_mode();
@@ -265,33 +480,29 @@ void tcu_uart_process_byte_received_in_command_mode(uint8_t input_byte)
             else if( command_analysis_result < 0 ) //Command not accepted
             {
                 LOG_ERR("Wrong AT command. Error code: %d", command_analysis_result);
-                for(uint8_t kk=0; kk<tcu_uart_rx_buffer_index; kk++)
-                {
-                    //LOG_ERR("%d", tcu_uart_rx_buffer[kk]);
-                }
             }
         }
-        tcu_uart_rx_buffer_index = 0;
-        b_tcu_uart_rx_buffer_overflow = false;
+        tcu_uart_at_command_index = 0;
+        b_tcu_uart_at_command_overflow = false;
     }
-    else if( !b_tcu_uart_rx_buffer_overflow )
+    else if( !b_tcu_uart_at_command_overflow )
     {
-        if( tcu_uart_rx_buffer_index >= UART_RX_BUFFER_SIZE )
+        if( tcu_uart_at_command_index >= UART_RX_BUFFER_SIZE )
         {
-            b_tcu_uart_rx_buffer_overflow = true;
+            b_tcu_uart_at_command_overflow = true;
         }
-        else if( tcu_uart_rx_buffer_index == 0 )
+        else if( tcu_uart_at_command_index == 0 )
         {
             if( (input_byte == 'A') || (input_byte == 'a') ) //Ignore received characters until the first 'A' or 'a' is received
             {
-                tcu_uart_rx_buffer[tcu_uart_rx_buffer_index] = input_byte;
-                tcu_uart_rx_buffer_index++;
+                tcu_uart_at_command_buffer[tcu_uart_at_command_index] = input_byte;
+                tcu_uart_at_command_index++;
             }
         }
         else
         {
-            tcu_uart_rx_buffer[tcu_uart_rx_buffer_index] = input_byte;
-            tcu_uart_rx_buffer_index++;
+            tcu_uart_at_command_buffer[tcu_uart_at_command_index] = input_byte;
+            tcu_uart_at_command_index++;
         }
     }
 }
@@ -302,25 +513,18 @@ void tcu_uart_process_byte_received_in_command_mode(uint8_t input_byte)
  */
 void tcu_uart_process_byte_received_in_transparent_mode(uint8_t input_byte)
 {
-    tcu_uart_rx_time_since_last_byte_ms = 0; //Reset timer used to detect end of frame
-
-    check_input_sequence_for_entering_in_command_mode(input_byte);
-
     if( b_tcu_uart_rx_receiving_frame )
     {
-        if( !b_tcu_uart_rx_corrupted_frame )
+        if( !b_tcu_uart_rx_buffer_overflow )
         {
-            if( !b_tcu_uart_rx_buffer_overflow )
+            if( tcu_uart_rx_buffer_index >= UART_RX_BUFFER_SIZE )
+            {
+                b_tcu_uart_rx_buffer_overflow = true;
+            }
+            else
             {
-                if( tcu_uart_rx_buffer_index >= UART_RX_BUFFER_SIZE )
-                {
-                    b_tcu_uart_rx_buffer_overflow = true;
-                }
-                else
-                {
-                    tcu_uart_rx_buffer[tcu_uart_rx_buffer_index] = input_byte;
-                    tcu_uart_rx_buffer_index++;
-                }
+                tcu_uart_rx_fill_buffer()[tcu_uart_rx_buffer_index] = input_byte;
+                tcu_uart_rx_buffer_index++;
             }
         }
     }
@@ -330,46 +534,177 @@ void tcu_uart_process_byte_received_in_transparent_mode(uint8_t input_byte)
         {            
             b_tcu_uart_rx_receiving_frame = true;
             b_tcu_uart_rx_buffer_overflow = false;
-            if( b_tcu_uart_rx_buffer_busy ) // Ignore new characters if we are still processing the last received frame.
-            {
-                b_tcu_uart_rx_corrupted_frame  = true;
-                LOG_ERR("Discarded frame. Buffer busy");
-            }
-            else
-            {
-                tcu_uart_rx_buffer[0] = input_byte;
-                tcu_uart_rx_buffer_index = 1;
+            tcu_uart_rx_fill_buffer()[0] = input_byte; // The slot at head is always free, no need to wait
+            tcu_uart_rx_buffer_index = 1;
+        }
+    }
+}
+
+/**@brief This function processes a chunk of bytes received throught the TCU's UART.
+ *        It is used by both the interrupt driven and the async backends.
+ *
+ * @param[in]   data   Pointer to the received bytes
+ * @param[in]   size   Number of received bytes
+ *
+ * @note Executed in interrupt context.
+ */
+void tcu_uart_process_received_chunk(const uint8_t *data, size_t size)
+{
+    k_spinlock_key_t key = k_spin_lock(&tcu_uart_rx_lock);
+    int64_t timestamp_ticks = k_uptime_ticks();
+    uint32_t silence_us = tcu_uart_ticks_to_us(timestamp_ticks - tcu_uart_last_rx_ticks); // Silence before the first byte of the chunk
+    bool b_events_stored = false;
+
+    for (size_t i = 0; i < size; i++) {
+        // In command mode every byte goes to the AT parser. In transparent mode only the "+"
+        // and the byte following a "+" matter to the detection of the "+++" sequence
+        if (b_zigbee_module_in_command_mode || (data[i] == '+') || b_tcu_uart_last_rx_byte_was_plus) {
+            tcu_uart_rx_event_t event = { .timestamp_ticks = timestamp_ticks, .silence_us = silence_us, .byte = data[i] };
+            if (k_msgq_put(&tcu_uart_rx_event_queue, &event, K_NO_WAIT) == 0) {
+                b_events_stored = true;
+            } else {
+                tcu_uart_rx_events_dropped++; // Not logged here, an overrun would flood the log
             }
         }
+        b_tcu_uart_last_rx_byte_was_plus = (data[i] == '+');
+        silence_us = 0;
+
+        if (!b_zigbee_module_in_command_mode) {
+            tcu_uart_process_byte_received_in_transparent_mode(data[i]);
+        }
+    }
+    tcu_uart_last_rx_ticks = timestamp_ticks;
+
+    if (b_events_stored) {
+        k_work_submit_to_queue(&tcu_uart_cmd_work_q, &tcu_uart_rx_event_work);
+    }
+
+    if (!b_zigbee_module_in_command_mode && b_tcu_uart_rx_receiving_frame && !b_tcu_uart_end_of_frame_timer_running) {
+        // Start the end of frame detection. Later bursts only move the timestamp the silence is measured from
+        b_tcu_uart_end_of_frame_timer_running = true;
+        k_timer_start(&tcu_uart_end_of_frame_timer, K_USEC(tcu_uart_end_of_frame_timeout_us), K_NO_WAIT);
+    }
+
+    k_spin_unlock(&tcu_uart_rx_lock, key);
+}
+
+#ifdef CONFIG_TCU_UART_ISR_STATS
+#if !defined(CONFIG_TCU_UART_ASYNC)
+static void tcu_uart_isr_latency_timer_handler(nrf_timer_event_t event_type, void *p_context)
+{
+    // TIMER1 only captures timestamps, its interrupt is not enabled
+    ARG_UNUSED(event_type);
+    ARG_UNUSED(p_context);
+}
+
+/**@brief Arm the (G)PPI channel that captures the next RXDRDY event of the TCU UART in CC0.
+ *
+ */
+static inline void tcu_uart_isr_latency_arm(void)
+{
+    nrf_timer_cc_set(tcu_uart_isr_latency_timer.p_reg, NRF_TIMER_CC_CHANNEL0, TCU_UART_ISR_LATENCY_NOT_CAPTURED);
+    nrfx_gppi_group_enable(tcu_uart_isr_latency_group);
+}
+
+/**@brief Set up the measurement of the RX interrupt latency: TIMER1 runs free at 16 MHz and a (G)PPI
+ *        channel connects the RXDRDY event of the UARTE to its capture task. The fork of the channel
+ *        disables the channel group, so a byte received while the previous one is being serviced
+ *        does not overwrite the timestamp.
+ *
+ */
+static void tcu_uart_isr_latency_init(void)
+{
+    NRF_UARTE_Type *uarte = (NRF_UARTE_Type *)DT_REG_ADDR(DT_NODELABEL(uart0));
+    nrfx_timer_config_t timer_config = NRFX_TIMER_DEFAULT_CONFIG(TCU_UART_ISR_LATENCY_TIMER_FREQ_HZ);
+    uint8_t channel;
+
+    timer_config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+    if( nrfx_timer_init(&tcu_uart_isr_latency_timer, &timer_config, tcu_uart_isr_latency_timer_handler) != NRFX_SUCCESS )
+    {
+        LOG_ERR("Error initializing the timer of the RX latency");
+        return;
+    }
+    if( ( nrfx_gppi_channel_alloc(&channel) != NRFX_SUCCESS ) ||
+        ( nrfx_gppi_group_alloc(&tcu_uart_isr_latency_group) != NRFX_SUCCESS ) )
+    {
+        LOG_ERR("Error allocating the PPI channel of the RX latency");
+        return;
+    }
+    nrfx_gppi_channel_endpoints_setup(channel, nrf_uarte_event_address_get(uarte, NRF_UARTE_EVENT_RXDRDY),
+                                      nrfx_timer_capture_task_address_get(&tcu_uart_isr_latency_timer, NRF_TIMER_CC_CHANNEL0));
+    nrfx_gppi_fork_endpoint_setup(channel, nrfx_gppi_task_address_get(nrfx_gppi_group_disable_task_get(tcu_uart_isr_latency_group)));
+    nrfx_gppi_channels_include_in_group(BIT(channel), tcu_uart_isr_latency_group);
+    nrfx_timer_enable(&tcu_uart_isr_latency_timer);
+    tcu_uart_isr_latency_arm();
+    b_tcu_uart_isr_latency_ready = true;
+}
+
+/**@brief Timestamp of the entry of the TCU UART interrupt, in TIMER1 ticks.
+ *
+ * @note Executed in interrupt context.
+ */
+static inline uint32_t tcu_uart_isr_latency_entry(void)
+{
+    if( !b_tcu_uart_isr_latency_ready ) return 0;
+    return nrfx_timer_capture(&tcu_uart_isr_latency_timer, NRF_TIMER_CC_CHANNEL1);
+}
+
+/**@brief Keep the worst service latency of the RX interrupt: time from the RXDRDY event of the byte
+ *        to the entry of the ISR. Bytes whose event came before the channel was armed again (they
+ *        waited in the RX FIFO of the UARTE while the previous byte was being serviced) are not
+ *        sampled. Then the channel is armed for the next byte.
+ *
+ * @param[in]   isr_entry_ticks   Timestamp taken at the entry of the interrupt
+ *
+ * @note Executed in interrupt context, after the received byte has been read.
+ */
+static void tcu_uart_isr_stats_rx(uint32_t isr_entry_ticks)
+{
+    if( !b_tcu_uart_isr_latency_ready ) return;
+
+    uint32_t rx_event_ticks = nrfx_timer_capture_get(&tcu_uart_isr_latency_timer, NRF_TIMER_CC_CHANNEL0);
+    if( rx_event_ticks != TCU_UART_ISR_LATENCY_NOT_CAPTURED )
+    {
+        tcu_uart_isr_max_rx_latency_ticks = MAX(tcu_uart_isr_max_rx_latency_ticks, isr_entry_ticks - rx_event_ticks);
+        tcu_uart_isr_rx_latency_samples++;
     }
+    tcu_uart_isr_latency_arm();
+}
+#endif
+
+/**@brief Keep the longest execution of the TCU UART interrupt.
+ *
+ * @param[in]   isr_start   Timestamp taken at the entry of the interrupt
+ *
+ * @note Executed in interrupt context.
+ */
+static void tcu_uart_isr_stats_duration(timing_t isr_start)
+{
+    timing_t isr_end = timing_counter_get();
+    tcu_uart_isr_max_duration_cycles = MAX(tcu_uart_isr_max_duration_cycles, timing_cycles_get(&isr_start, &isr_end));
 }
+#endif
 
 void handle_uart_rx(void)
 {
     uint8_t uart_rx_hw_fifo[SIZE_OF_RX_FIFO_OF_NRF52840_UART];
-    uint8_t uart_rx_hw_fifo_index = 0;
 
     int number_of_bytes_available = uart_fifo_read(dev_tcu_uart, uart_rx_hw_fifo, SIZE_OF_RX_FIFO_OF_NRF52840_UART);
-    while (number_of_bytes_available > 0) {
-        number_of_bytes_available--;
-        uint8_t byte_received = uart_rx_hw_fifo[uart_rx_hw_fifo_index];
-        uart_rx_hw_fifo_index++;
-
-        if (b_zigbee_module_in_command_mode) {
-            tcu_uart_process_byte_received_in_command_mode(byte_received);
-        } else {
-            tcu_uart_process_byte_received_in_transparent_mode(byte_received);
-        }
+    if (number_of_bytes_available > 0) {
+#ifdef CONFIG_TCU_UART_ISR_STATS
+        if( uart_err_check(dev_tcu_uart) & UART_ERROR_OVERRUN ) tcu_uart_isr_overruns++;
+#endif
+        tcu_uart_process_received_chunk(uart_rx_hw_fifo, number_of_bytes_available);
     }
 }
 
 void handle_uart_tx(void)
 {
     if (tcu_transmission_running) {
-        if (tcu_transmission_buffer_index < tcu_transmission_buffer.size) {
+        if (tcu_transmission_buffer_index < tcu_transmission_chunk_size) {
 
             // Calculate the number of bytes remaining to send
-            size_t bytes_remaining = tcu_transmission_buffer.size - tcu_transmission_buffer_index;
+            size_t bytes_remaining = tcu_transmission_chunk_size - tcu_transmission_buffer_index;
 
             // Calculate the number of bytes to send in this chunk (max 8 bytes)
             size_t bytes_to_send = (bytes_remaining < UART_CHUNK_SIZE) ? bytes_remaining : UART_CHUNK_SIZE;
@@ -377,24 +712,23 @@ void handle_uart_tx(void)
 
             // Send up to 8 bytes from the current index in the buffer
             int ret = uart_fifo_fill(dev_tcu_uart, 
-                                     &tcu_transmission_buffer.buffer[tcu_transmission_buffer_index], 
+                                     &tcu_transmission_chunk[tcu_transmission_buffer_index],
                                      bytes_to_send);
 
-            //int ret = uart_fifo_fill(dev_tcu_uart, (uint8_t *)&tcu_transmission_buffer.buffer, tcu_transmission_buffer.size);
             if (ret > 0) {
                 //LOG_WRN("Sent %d bytes", ret);
                 tcu_transmission_buffer_index += ret;
             } else 
             {
                 LOG_ERR("Error filling UART FIFO: %d", ret);
-                tcu_transmission_running = false;
 			    uart_irq_tx_disable(dev_tcu_uart);
+                tcu_uart_tx_done(true);
 			    return;
             }
         } else 
         {
-            tcu_transmission_running = false;
             uart_irq_tx_disable(dev_tcu_uart);
+            tcu_uart_tx_done(false);
             //LOG_WRN("Transmission complete.");
         }
     }
@@ -407,6 +741,12 @@ void handle_uart_tx(void)
 void tcu_uart_isr(const struct device *dev, void *user_data)
 {
     ARG_UNUSED(user_data);
+#if defined(CONFIG_TCU_UART_ISR_STATS) && !defined(CONFIG_TCU_UART_ASYNC)
+    uint32_t isr_entry_ticks = tcu_uart_isr_latency_entry();
+#endif
+#ifdef CONFIG_TCU_UART_ISR_STATS
+    timing_t isr_start = timing_counter_get();
+#endif
 
 	if( !uart_irq_update(dev_tcu_uart) )
     {
@@ -416,12 +756,197 @@ void tcu_uart_isr(const struct device *dev, void *user_data)
 
     if (uart_irq_rx_ready(dev_tcu_uart)) {
         handle_uart_rx();
+#if defined(CONFIG_TCU_UART_ISR_STATS) && !defined(CONFIG_TCU_UART_ASYNC)
+        tcu_uart_isr_stats_rx(isr_entry_ticks);
+#endif
     }
 
     if (uart_irq_tx_ready(dev_tcu_uart)) {
         handle_uart_tx();
     }
+
+#ifdef CONFIG_TCU_UART_ISR_STATS
+    tcu_uart_isr_stats_duration(isr_start);
+#endif
+}
+
+/**@brief Claim the next contiguous part of the message being transmitted and start sending it.
+ *        A message that wraps around the end of the TX ring is sent in two parts.
+ *
+ * @retval true Transmission started
+ * @retval false Error, the rest of the message has been discarded
+ *
+ * @note Called with tcu_uart_tx_lock held.
+ */
+static bool tcu_uart_tx_start_chunk(void)
+{
+    uint8_t *chunk;
+
+    tcu_transmission_chunk_size = ring_buf_get_claim(&tcu_uart_tx_ring, &chunk, tcu_transmission_pending_size);
+    tcu_transmission_chunk = chunk;
+    tcu_transmission_pending_size -= tcu_transmission_chunk_size;
+    tcu_transmission_buffer_index = 0;
+#if defined(CONFIG_TCU_UART_ASYNC)
+    int ret = tcu_uart_async_tx_start();
+    if( ret < 0 )
+    {
+        LOG_ERR("Error starting UART transmission: %d", ret);
+        ring_buf_get_finish(&tcu_uart_tx_ring, tcu_transmission_chunk_size);
+        ring_buf_get(&tcu_uart_tx_ring, NULL, tcu_transmission_pending_size);
+        tcu_transmission_chunk_size = 0;
+        tcu_transmission_pending_size = 0;
+        return false;
+    }
+#else
+    uart_irq_tx_enable(dev_tcu_uart);  // The TX interrupt fills the FIFO, starting from the first byte
+#endif
+    return true;
+}
+
+/**@brief Called by the UART backend when the transmission of the claimed part of the current
+ *        message has finished. The part is released from the TX ring and, if the message wraps
+ *        around the end of the ring, its second part is started.
+ *
+ * @param[in]   b_error     The transmission failed: the rest of the message is discarded
+ *
+ * @note Executed in interrupt context.
+ */
+void tcu_uart_tx_done(bool b_error)
+{
+    k_spinlock_key_t key = k_spin_lock(&tcu_uart_tx_lock);
+
+    ring_buf_get_finish(&tcu_uart_tx_ring, tcu_transmission_chunk_size);
+    tcu_transmission_chunk_size = 0;
+    if( b_error && ( tcu_transmission_pending_size > 0 ) )
+    {
+        ring_buf_get(&tcu_uart_tx_ring, NULL, tcu_transmission_pending_size);
+        tcu_transmission_pending_size = 0;
+    }
+
+    if( ( tcu_transmission_pending_size == 0 ) || !tcu_uart_tx_start_chunk() )
+    {
+        tcu_transmission_running = false;
+        b_tcu_uart_tx_gap_running = true;
+        // When the backend reports the end, the last character is still being shifted out
+        k_timer_start(&tcu_uart_tx_gap_timer, K_USEC(tcu_uart_tx_gap_us + tcu_uart_char_time_us), K_NO_WAIT);
+    }
+
+    k_spin_unlock(&tcu_uart_tx_lock, key);
+}
+
+/**@brief Expiry function of the TX inter-frame gap timer: the line has been silent long enough,
+ *        so the next queued message (if any) is started.
+ *
+ * @note Executed in interrupt context.
+ */
+static void tcu_uart_tx_gap_timer_handler(struct k_timer *timer)
+{
+    ARG_UNUSED(timer);
+
+    b_tcu_uart_tx_gap_running = false;
+    tcu_uart_tx_start_next();
+}
+
+/**@brief Start the transmission of the next queued message, unless a transmission or an
+ *        inter-frame gap is in progress. Called when a message is queued and when the gap expires.
+ *
+ * @note Can be called from thread or interrupt context.
+ */
+void tcu_uart_tx_start_next(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&tcu_uart_tx_lock);
+
+    if( !tcu_transmission_running && !b_tcu_uart_tx_gap_running && !ring_buf_is_empty(&tcu_uart_tx_ring) )
+    {
+        tcu_message_length_t length;
+
+        ring_buf_get(&tcu_uart_tx_ring, (uint8_t *)&length, sizeof(length));
+        tcu_transmission_pending_size = length;
+        tcu_transmission_running = true;
+        if( !tcu_uart_tx_start_chunk() )
+        {
+            tcu_transmission_running = false;
+        }
+    }
+
+    k_spin_unlock(&tcu_uart_tx_lock, key);
+}
+
+#if defined(CONFIG_TCU_UART_ASYNC)
+/**@brief Enable async reception on the next DMA buffer of the ring
+ *
+ * @retval 0 OK
+ * @retval Negative value Error code returned by the driver
+ */
+static int tcu_uart_async_rx_start(void)
+{
+    uint8_t *buffer = tcu_uart_async_rx_buffers[tcu_uart_async_rx_next_buffer];
+
+    tcu_uart_async_rx_next_buffer = (tcu_uart_async_rx_next_buffer + 1) % TCU_UART_ASYNC_RX_BUFFER_COUNT;
+    return uart_rx_enable(dev_tcu_uart, buffer, TCU_UART_ASYNC_RX_BUFFER_SIZE, tcu_uart_async_rx_timeout_us);
+}
+
+/**@brief Send the part of the message claimed from the TX ring with a single DMA
+ *        transfer (async backend). Completion is notified with the UART_TX_DONE event.
+ *
+ * @retval 0 OK
+ * @retval Negative value Error code returned by the driver
+ */
+static int tcu_uart_async_tx_start(void)
+{
+    return uart_tx(dev_tcu_uart, tcu_transmission_chunk, tcu_transmission_chunk_size, SYS_FOREVER_US);
+}
+
+/**@brief Event handler of the TCU UART when the async backend is used.
+ *        Received chunks are passed to the framing layer and the end of transmissions notified.
+ *
+ * @note Executed in interrupt context.
+ */
+static void tcu_uart_async_cb(const struct device *dev, struct uart_event *evt, void *user_data)
+{
+    ARG_UNUSED(user_data);
+#ifdef CONFIG_TCU_UART_ISR_STATS
+    timing_t isr_start = timing_counter_get();
+#endif
+
+    switch (evt->type) {
+    case UART_RX_RDY:
+        tcu_uart_process_received_chunk(&evt->data.rx.buf[evt->data.rx.offset], evt->data.rx.len);
+        break;
+    case UART_RX_BUF_REQUEST:
+        // The chunks of a buffer are processed when they are delivered, so the buffer can be reused.
+        uart_rx_buf_rsp(dev, tcu_uart_async_rx_buffers[tcu_uart_async_rx_next_buffer], TCU_UART_ASYNC_RX_BUFFER_SIZE);
+        tcu_uart_async_rx_next_buffer = (tcu_uart_async_rx_next_buffer + 1) % TCU_UART_ASYNC_RX_BUFFER_COUNT;
+        break;
+    case UART_RX_BUF_RELEASED:
+        break;
+    case UART_RX_STOPPED:
+#ifdef CONFIG_TCU_UART_ISR_STATS
+        if( evt->data.rx_stop.reason & UART_ERROR_OVERRUN ) tcu_uart_isr_overruns++;
+#endif
+        LOG_ERR("TCU UART reception stopped, reason %d", evt->data.rx_stop.reason);
+        break;
+    case UART_RX_DISABLED:
+        if (tcu_uart_async_rx_start() < 0) { // Reception has to be always enabled
+            LOG_ERR("Error restarting UART async reception");
+        }
+        break;
+    case UART_TX_DONE:
+        tcu_transmission_buffer_index = evt->data.tx.len;
+        tcu_uart_tx_done(false);
+        break;
+    case UART_TX_ABORTED:
+        LOG_ERR("TCU UART transmission aborted");
+        tcu_uart_tx_done(true);
+        break;
+    default:
+        break;
+    }
+#ifdef CONFIG_TCU_UART_ISR_STATS
+    tcu_uart_isr_stats_duration(isr_start);
+#endif
 }
+#endif
 
 /**@brief Queue a message to be sent through the TCU UART
  *
@@ -436,35 +961,99 @@ int8_t queue_zigbee_Message(uint8_t *input_data, uint16_t size_input_data)
         return -1;
     }
 
-    LOG_DBG("Queueing message of size %d", size_input_data);
-    LOG_HEXDUMP_DBG(input_data, size_input_data,"Payload of output queueMessage packet");
-
-    // Create a buffer to hold the message (if needed)
-    tcu_message message_buffer;
-    memcpy(message_buffer.buffer, input_data, size_input_data);
-    message_buffer.size = size_input_data;
+    PACKET_LOG_DBG("Queueing message of size %d", size_input_data);
+    PACKET_LOG_HEXDUMP_DBG(input_data, size_input_data,"Payload of output queueMessage packet");
 
-    int ret = k_msgq_put(&tcu_uart_tx_message_queue, &message_buffer, K_NO_WAIT);
+    tcu_message_length_t length = size_input_data;
+    k_spinlock_key_t key = k_spin_lock(&tcu_uart_tx_lock);
 
-    if (ret == 0) {
-        //LOG_DBG("Message queued successfully");
-    } else if (ret == -ENOMSG) {
+    if (ring_buf_space_get(&tcu_uart_tx_ring) < sizeof(length) + size_input_data) {
+        k_spin_unlock(&tcu_uart_tx_lock, key);
         LOG_ERR("Message queue is full");
+        return -ENOMSG;
     }
-    else {
-        LOG_ERR("Error queuing message");
-    }
-    return ret;
+    ring_buf_put(&tcu_uart_tx_ring, (uint8_t *)&length, sizeof(length));
+    ring_buf_put(&tcu_uart_tx_ring, input_data, size_input_data);
+    tcu_uart_tx_ring_high_water_mark = MAX(tcu_uart_tx_ring_high_water_mark, ring_buf_size_get(&tcu_uart_tx_ring));
+
+    k_spin_unlock(&tcu_uart_tx_lock, key);
+
+    tcu_uart_tx_start_next();
+    return 0;
+}
+
+/**@brief Maximum number of bytes that have been used in the TX ring (downlink message queue)
+ *
+ */
+uint32_t tcu_uart_get_tx_queue_high_water_mark(void)
+{
+    return tcu_uart_tx_ring_high_water_mark;
+}
+
+/**@brief Number of received bytes lost because the RX event queue of the command mode was full
+ *
+ */
+uint32_t tcu_uart_get_rx_events_dropped(void)
+{
+    return tcu_uart_rx_events_dropped;
+}
+
+/**@brief Number of frames received from the TCU and discarded before reaching the APS queue
+ *
+ * @param[out]  ring_full   Frames lost because all the slots of the RX frame ring were pending
+ * @param[out]  overflow    Frames lost because they were longer than UART_RX_BUFFER_SIZE
+ */
+void tcu_uart_get_rx_frames_discarded(uint32_t *ring_full, uint32_t *overflow)
+{
+    *ring_full = tcu_uart_rx_frames_discarded_ring_full;
+    *overflow = tcu_uart_rx_frames_discarded_overflow;
+}
+
+/**@brief Number of downlink frames not sent to the TCU, because the module was in command mode
+ *        or the frame was shorter than a Modbus frame
+ *
+ */
+uint32_t tcu_uart_get_downlink_frames_discarded(void)
+{
+    return tcu_uart_downlink_frames_discarded;
 }
 
+#ifdef CONFIG_TCU_UART_ISR_STATS
+/**@brief Copy of the statistics of the TCU uart interrupt
+ *
+ * @param[out]  stats   Worst values measured since the start up
+ */
+void tcu_uart_get_isr_stats(tcu_uart_isr_stats_t *stats)
+{
+    uint64_t max_rx_latency_ticks = 0;
+    unsigned int key = irq_lock();
+    uint64_t max_duration_cycles = tcu_uart_isr_max_duration_cycles;
+    stats->overruns = tcu_uart_isr_overruns;
+    stats->rx_latency_samples = 0;
+#if !defined(CONFIG_TCU_UART_ASYNC)
+    max_rx_latency_ticks = tcu_uart_isr_max_rx_latency_ticks;
+    stats->rx_latency_samples = tcu_uart_isr_rx_latency_samples;
+#endif
+    irq_unlock(key);
+
+#if !defined(CONFIG_TCU_UART_ASYNC)
+    stats->max_rx_latency_ns = (uint32_t)MIN(max_rx_latency_ticks * NSEC_PER_SEC / TCU_UART_ISR_LATENCY_TIMER_FREQ_HZ, UINT32_MAX);
+#else
+    stats->max_rx_latency_ns = 0;
+#endif
+    stats->max_isr_duration_ns = (uint32_t)MIN(timing_cycles_to_ns(max_duration_cycles), UINT32_MAX);
+}
+#endif
+
 /**@brief Switch the TCU uart to command mode
  *
  *
  */
 void switch_tcu_uart_to_command_mode(void)
 {
-    tcu_uart_rx_buffer_index = 0;
-    leave_cmd_mode_silence_timer_ms = 0;
+    tcu_uart_at_command_index = 0;
+    b_tcu_uart_at_command_overflow = false;
+    k_work_reschedule_for_queue(&tcu_uart_cmd_work_q, &tcu_uart_cmd_mode_timeout_work, K_MSEC(TCU_UART_CMD_MODE_TIMEOUT_MS));
     if( !b_zigbee_module_in_command_mode )
     {
         b_zigbee_module_in_command_mode = true;
@@ -478,8 +1067,11 @@ void switch_tcu_uart_to_command_mode(void)
  */
 void switch_tcu_uart_out_of_command_mode(void)
 {
+    // The frame being received is owned by the ISR and the end of frame timer
+    k_spinlock_key_t key = k_spin_lock(&tcu_uart_rx_lock);
     tcu_uart_rx_buffer_init();
     b_zigbee_module_in_command_mode = false;
+    k_spin_unlock(&tcu_uart_rx_lock, key);
     LOG_DBG("Leave command mode");
 }
 
@@ -493,156 +1085,621 @@ bool is_tcu_uart_in_command_mode(void)
     return b_zigbee_module_in_command_mode;
 }
 
-/**@brief Check if the TCU has sent the "+++" sequence
+/**@brief Check if the TCU has sent the "+++" sequence. The first "+" has to follow a guard time
+ *        of silence. After the third one, the guard time work checks the final silence.
  *
- * @param[in]   input_byte   Last byte received through the TCU UART
+ * @param[in]   input_byte          Byte received through the TCU UART
+ * @param[in]   silence_us          Silence in the line before the byte [us]
+ * @param[in]   timestamp_ticks     System uptime [ticks] when the byte was received
  *
+ * @note Executed in the TCU UART command work queue.
  */
-void check_input_sequence_for_entering_in_command_mode(uint8_t input_byte)
+void check_input_sequence_for_entering_in_command_mode(uint8_t input_byte, uint32_t silence_us, int64_t timestamp_ticks)
 {
+    if( enter_cmd_mode_sequence_st == ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_END_SILENCE_ST )
+    {
+        k_work_cancel_delayable(&tcu_uart_guard_time_work); // Any byte breaks the final silence
+        enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_FIRST_CHAR_ST;
+    }
+
     if( input_byte == '+' )
     {
-        if( enter_cmd_mode_sequence_st == ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_FIRST_CHAR_ST )
-        {
-            enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_SECOND_CHAR_ST;
-        }
-        else if( enter_cmd_mode_sequence_st == ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_SECOND_CHAR_ST )
+        if( enter_cmd_mode_sequence_st == ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_SECOND_CHAR_ST )
         {
             enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_THIRD_CHAR_ST;
         }
         else if( enter_cmd_mode_sequence_st == ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_THIRD_CHAR_ST )
         {
+            uint32_t elapsed_us = tcu_uart_us_since(timestamp_ticks);
+            uint32_t guard_time_us = TCU_UART_CMD_MODE_GUARD_TIME_MS * 1000UL;
+
             enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_END_SILENCE_ST;
+            k_work_reschedule_for_queue(&tcu_uart_cmd_work_q, &tcu_uart_guard_time_work,
+                                        K_USEC( ( elapsed_us < guard_time_us ) ? ( guard_time_us - elapsed_us ) : 0 ));
+        }
+        else if( silence_us >= TCU_UART_CMD_MODE_GUARD_TIME_MS * 1000UL )
+        {
+            enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_SECOND_CHAR_ST;
         }
         else
         {
-            pre_silence_timer_ms = 0;
-            enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_INITIAL_SILENCE_ST;
+            enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_FIRST_CHAR_ST;
+        }
+    }
+    else
+    {
+        enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_FIRST_CHAR_ST;
+    }
+}
+
+/**@brief Process the RX events stored by the ISR: "+++" detection and, in command mode, AT commands
+ *
+ * @note Executed in the TCU UART command work queue.
+ */
+static void tcu_uart_rx_event_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    tcu_uart_rx_event_t event;
+
+    while( k_msgq_get(&tcu_uart_rx_event_queue, &event, K_NO_WAIT) == 0 )
+    {
+        check_input_sequence_for_entering_in_command_mode(event.byte, event.silence_us, event.timestamp_ticks); // It also has to be checked when we are already in command mode.
+        if( b_zigbee_module_in_command_mode )
+        {
+            tcu_uart_process_byte_received_in_command_mode(event.byte);
         }
     }
+}
+
+/**@brief Executed when the guard time after the third "+" has elapsed without any other byte
+ *        received: the Zigbee module enters in command mode.
+ *
+ * @note Executed in the TCU UART command work queue.
+ */
+static void tcu_uart_guard_time_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    tcu_uart_rx_event_work_handler(NULL); // A byte received just before the expiry may still be pending
+
+    if( enter_cmd_mode_sequence_st == ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_END_SILENCE_ST )
+    {
+        enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_FIRST_CHAR_ST;
+        switch_tcu_uart_to_command_mode();
+        digi_at_reply_ok();
+    }
+}
+
+/**@brief Leave command mode after a silence of TCU_UART_CMD_MODE_TIMEOUT_MS. The silence is
+ *        measured from the timestamp of the last byte received; if the line has not been silent
+ *        long enough the work is rescheduled for the remaining time.
+ *
+ * @note Executed in the TCU UART command work queue.
+ */
+static void tcu_uart_cmd_mode_timeout_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    k_spinlock_key_t key = k_spin_lock(&tcu_uart_rx_lock); // The 64 bit timestamp is written by the ISR
+    uint32_t silence_ms = tcu_uart_us_since(tcu_uart_last_rx_ticks) / 1000;
+    k_spin_unlock(&tcu_uart_rx_lock, key);
+
+    if( !b_zigbee_module_in_command_mode ) return;
+
+    if( silence_ms < TCU_UART_CMD_MODE_TIMEOUT_MS )
+    {
+        k_work_reschedule_for_queue(&tcu_uart_cmd_work_q, &tcu_uart_cmd_mode_timeout_work, K_MSEC(TCU_UART_CMD_MODE_TIMEOUT_MS - silence_ms));
+    }
+    else
+    {
+        switch_tcu_uart_out_of_command_mode();
+    }
+}
+
+/**@brief Start tracking the TCU frames sent in one or several APS frames, once the first APS frame
+ *        has been queued.
+ *
+ * @param[in]   handle                  Handle of the first APS frame
+ * @param[in]   aps_frames              Number of APS frames that will be queued for the TCU frames
+ * @param[in]   tcu_frames              Number of TCU frames (more than one if they were aggregated)
+ * @param[in]   tcu_bytes               TCU payload bytes
+ * @param[in]   enqueue_time_first_ms   Time when the first TCU frame was queued
+ * @param[in]   enqueue_time_sum_ms     Sum of the times when every TCU frame was queued
+ *
+ * @return Entry used, NULL if the table is full (the frames are sent but not accounted)
+ *
+ * @note Called with tcu_uart_uplink_lock held.
+ */
+static tcu_uart_uplink_frame_t *tcu_uart_uplink_track(zb_uint16_t handle, uint8_t aps_frames, uint8_t tcu_frames,
+                                                      uint16_t tcu_bytes, uint32_t enqueue_time_first_ms,
+                                                      uint32_t enqueue_time_sum_ms)
+{
+    for( uint8_t i = 0; i < TCU_UART_UPLINK_TRACKED_FRAMES; i++ )
+    {
+        tcu_uart_uplink_frame_t *entry = &tcu_uart_uplink_frames[i];
+
+        if( entry->aps_frames_pending != 0 ) continue;
+
+        entry->first_handle = handle;
+        entry->last_handle = handle;
+        entry->aps_frames_pending = aps_frames;
+        entry->b_failed = false;
+        entry->tcu_frames = tcu_frames;
+        entry->tcu_bytes = tcu_bytes;
+        entry->enqueue_time_first_ms = enqueue_time_first_ms;
+        entry->enqueue_time_sum_ms = enqueue_time_sum_ms;
+        if( tcu_uart_uplink_frames_in_flight++ == 0 ) tcu_uart_uplink_busy_start_ms = k_uptime_get_32();
+        return entry;
+    }
+    return NULL;
+}
+
+/**@brief Account the TCU frames of an entry whose APS frames have all completed, and free it
+ *
+ * @note Called with tcu_uart_uplink_lock held.
+ */
+static void tcu_uart_uplink_complete(tcu_uart_uplink_frame_t *entry)
+{
+    uint32_t time_now_ms = k_uptime_get_32();
+
+    if( entry->b_failed )
+    {
+        tcu_uart_uplink_statistics.frames_failed += entry->tcu_frames;
+        tcu_uart_frames_not_delivered_counter += entry->tcu_frames;
+    }
     else
     {
-        pre_silence_timer_ms = 0;
-        enter_cmd_mode_sequence_st = ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_INITIAL_SILENCE_ST;
+        tcu_uart_uplink_statistics.frames_delivered += entry->tcu_frames;
+        tcu_uart_uplink_statistics.bytes_delivered += entry->tcu_bytes;
+        // Sum of the latencies of the TCU frames, the modular arithmetic cancels the wrap of the sum
+        tcu_uart_uplink_statistics.latency_sum_ms += entry->tcu_frames * time_now_ms - entry->enqueue_time_sum_ms;
+        tcu_uart_uplink_statistics.latency_max_ms = MAX(tcu_uart_uplink_statistics.latency_max_ms,
+                                                        time_now_ms - entry->enqueue_time_first_ms);
+    }
+    entry->aps_frames_pending = 0;
+
+    if( --tcu_uart_uplink_frames_in_flight == 0 )
+    {
+        tcu_uart_uplink_statistics.busy_time_ms += time_now_ms - tcu_uart_uplink_busy_start_ms;
+    }
+}
+
+/**@brief Executed when the transmission of an APS frame with data received from the TCU has finished.
+ *        The TCU frame is accounted when its last APS frame completes. Frames that did not reach the
+ *        coordinator are counted.
+ *
+ * @note Executed in the Zigbee thread.
+ */
+static void tcu_uart_uplink_status_cb(zb_uint16_t handle, zb_ret_t status, uint32_t latency_ms)
+{
+    k_spinlock_key_t key = k_spin_lock(&tcu_uart_uplink_lock);
+
+    for( uint8_t i = 0; i < TCU_UART_UPLINK_TRACKED_FRAMES; i++ )
+    {
+        tcu_uart_uplink_frame_t *entry = &tcu_uart_uplink_frames[i];
+
+        if( ( entry->aps_frames_pending != 0 ) &&
+            ( (zb_uint16_t)( handle - entry->first_handle ) <= (zb_uint16_t)( entry->last_handle - entry->first_handle ) ) )
+        {
+            if( status != RET_OK ) entry->b_failed = true;
+            if( --entry->aps_frames_pending == 0 ) tcu_uart_uplink_complete(entry);
+            break;
+        }
+    }
+
+    k_spin_unlock(&tcu_uart_uplink_lock, key);
+
+    if( status != RET_OK ) LOG_WRN("TCU frame %d not delivered (status %d, %d ms)", handle, status, latency_ms);
+}
+
+/**@brief Copy of the statistics of the uplink
+ *
+ * @param[out]  statistics   Values accounted since the start up or the last reset
+ * @param[in]   b_reset      Start a new measurement window after the copy
+ */
+void tcu_uart_get_uplink_statistics(tcu_uart_uplink_statistics_t *statistics, bool b_reset)
+{
+    k_spinlock_key_t key = k_spin_lock(&tcu_uart_uplink_lock);
+    uint32_t time_now_ms = k_uptime_get_32();
+
+    if( tcu_uart_uplink_frames_in_flight > 0 ) // Close the busy period so far
+    {
+        tcu_uart_uplink_statistics.busy_time_ms += time_now_ms - tcu_uart_uplink_busy_start_ms;
+        tcu_uart_uplink_busy_start_ms = time_now_ms;
+    }
+    *statistics = tcu_uart_uplink_statistics;
+    if( b_reset ) memset(&tcu_uart_uplink_statistics, 0, sizeof(tcu_uart_uplink_statistics));
+
+    k_spin_unlock(&tcu_uart_uplink_lock, key);
+}
+
+/**@brief Print the statistics of the uplink: TCU frames, latency per TCU frame and goodput of the
+ *        TCU payload while there were frames in flight
+ *
+ */
+void tcu_uart_log_uplink_statistics(void)
+{
+    tcu_uart_uplink_statistics_t statistics;
+
+    tcu_uart_get_uplink_statistics(&statistics, false);
+    if( statistics.frames_delivered == 0 ) return;
+
+    LOG_INF("Uplink (%s fragmentation): %d TCU frames (%d failed), %d bytes, latency avg %d ms max %d ms, goodput %d B/s",
+            TCU_UART_UPLINK_FRAGMENTATION_NAME,
+            statistics.frames_delivered,
+            statistics.frames_failed,
+            statistics.bytes_delivered,
+            statistics.latency_sum_ms / statistics.frames_delivered,
+            statistics.latency_max_ms,
+            statistics.busy_time_ms ? (uint32_t)((uint64_t)statistics.bytes_delivered * 1000 / statistics.busy_time_ms) : 0);
+}
+
+#ifdef CONFIG_TCU_UART_UPLINK_AGGREGATION
+/**@brief Queue for transmission the APS frame being aggregated, if any.
+ *
+ */
+static void tcu_uart_flush_aggregated_frame(void)
+{
+    if( tcu_uart_aggregated_frame == NULL ) return;
+
+    tcu_uart_aggregated_frame = NULL;
+
+    k_spinlock_key_t key = k_spin_lock(&tcu_uart_uplink_lock); // Tracked before its status can be reported
+    zb_uint16_t handle = zigbee_aps_commit_frame(APS_PRIORITY_DATA);
+    if( handle != 0 )
+    {
+        tcu_uart_uplink_track(handle, 1, tcu_uart_aggregated_records, tcu_uart_aggregated_bytes, tcu_uart_aggregated_frame_start_ms,
+                              tcu_uart_aggregated_time_sum_ms);
+    }
+    k_spin_unlock(&tcu_uart_uplink_lock, key);
+
+    if( handle == 0 ) LOG_ERR("Aggregated frame could not be queued");
+}
+
+/**@brief Add a frame received from the TCU as a record of the APS frame being aggregated.
+ *        A new APS frame is started when there is not one or the record does not fit in it.
+ *
+ * @param[in]   frame        Pointer to the received frame
+ * @param[in]   frame_size   Size of the received frame (up to TCU_UART_AGGREGATION_RECORD_MAX)
+ *
+ * @retval true The frame was added
+ * @retval false Not free space of aps output frame queue
+ */
+static bool tcu_uart_aggregate_received_frame(const uint8_t *frame, uint16_t frame_size)
+{
+    if( ( tcu_uart_aggregated_frame != NULL ) &&
+        ( tcu_uart_aggregated_frame->payload_size + 1 + frame_size > APS_UNENCRYPTED_PAYLOAD_MAX ) )
+    {
+        tcu_uart_flush_aggregated_frame();
+    }
+
+    if( tcu_uart_aggregated_frame == NULL )
+    {
+        tcu_uart_aggregated_frame = zigbee_aps_reserve_frame(APS_PRIORITY_DATA);
+        if( tcu_uart_aggregated_frame == NULL ) return false;
+
+        tcu_uart_aggregated_frame->dst_addr.addr_short = COORDINATOR_SHORT_ADDRESS;
+        tcu_uart_aggregated_frame->cluster_id = DIGI_AGGREGATED_DATA_CLUSTER;
+        tcu_uart_aggregated_frame->src_endpoint = DIGI_BINARY_VALUE_SOURCE_ENDPOINT;
+        tcu_uart_aggregated_frame->dst_endpoint = DIGI_BINARY_VALUE_DESTINATION_ENDPOINT;
+        tcu_uart_aggregated_frame->status_cb = tcu_uart_uplink_status_cb; // One report for all the records
+        tcu_uart_aggregated_frame->payload_size = 0;
+        tcu_uart_aggregated_frame_start_ms = k_uptime_get_32();
+        tcu_uart_aggregated_records = 0;
+        tcu_uart_aggregated_bytes = 0;
+        tcu_uart_aggregated_time_sum_ms = 0;
     }
+
+    tcu_uart_aggregated_records++;
+    tcu_uart_aggregated_bytes += frame_size;
+    tcu_uart_aggregated_time_sum_ms += k_uptime_get_32();
+
+    tcu_uart_aggregated_frame->payload[tcu_uart_aggregated_frame->payload_size++] = (zb_uint8_t)frame_size;
+    memcpy(&tcu_uart_aggregated_frame->payload[tcu_uart_aggregated_frame->payload_size], frame, frame_size);
+    tcu_uart_aggregated_frame->payload_size += frame_size;
+
+    // Not even an empty record would fit any more
+    if( tcu_uart_aggregated_frame->payload_size + 2 > APS_UNENCRYPTED_PAYLOAD_MAX ) tcu_uart_flush_aggregated_frame();
+
+    return true;
 }
+#endif
 
 /**@brief This function places in the APS output frame queue a frame received through
 *         the TCU UART when the zigbee module is in transparent mode.
+*
+* @param[in]   frame        Pointer to the received frame (read in place from the RX frame ring)
+* @param[in]   frame_size   Size of the received frame
 */
-bool tcu_uart_send_received_frame_through_zigbee(void)
+bool tcu_uart_send_received_frame_through_zigbee(const uint8_t *frame, uint16_t frame_size)
 {
     bool b_return = false;
+    uint16_t offset = 0;
+    uint16_t cluster_id = DIGI_BINARY_VALUE_CLUSTER;
+    uint8_t header_size = 0;
+    uint8_t fragment_data_max;
+    uint8_t fragment_count;
+    uint8_t fragments_queued = 0;
+    tcu_uart_uplink_frame_t *tracked_frame = NULL;
+    uint32_t enqueue_time_ms = k_uptime_get_32();
+
+#ifdef CONFIG_TCU_UART_UPLINK_AGGREGATION
+    if( frame_size <= TCU_UART_AGGREGATION_RECORD_MAX )
+    {
+        b_return = tcu_uart_aggregate_received_frame(frame, frame_size);
+        if( !b_return ) LOG_ERR("Not free space of aps output frame queue");
+        return b_return;
+    }
+    tcu_uart_flush_aggregated_frame(); // Keep the order of the frames
+#endif
 
-    if( zigbee_aps_get_output_frame_buffer_free_space() )
+#ifdef CONFIG_TCU_UART_UPLINK_FRAGMENTATION_SEQUENCED
+    if( frame_size > APS_UNENCRYPTED_PAYLOAD_MAX )
     {
-        aps_output_frame_t element;
+        header_size = DIGI_FRAGMENT_HEADER_SIZE;
+        cluster_id = DIGI_FRAGMENTED_DATA_CLUSTER;
+    }
+#endif
+    fragment_data_max = APS_FRAME_PAYLOAD_MAX - header_size; // The whole frame with CONFIG_TCU_UART_UPLINK_FRAGMENTATION_STACK
+    fragment_count = (uint8_t)((frame_size + fragment_data_max - 1) / fragment_data_max);
 
-        element.dst_addr.addr_short = COORDINATOR_SHORT_ADDRESS;
-        element.cluster_id = DIGI_BINARY_VALUE_CLUSTER;
-        element.src_endpoint = DIGI_BINARY_VALUE_SOURCE_ENDPOINT;
-        element.dst_endpoint = DIGI_BINARY_VALUE_DESTINATION_ENDPOINT;
-        element.payload_size = tcu_uart_rx_buffer_frame_size;
+    // All or nothing: a frame whose fragments do not fit in the queue is not queued at all
+    if( zigbee_aps_get_output_frame_buffer_free_space(APS_PRIORITY_DATA) < fragment_count )
+    {
+        LOG_ERR("Not free space of aps output frame queue for the %d fragments of a frame", fragment_count);
+        return false;
+    }
+    if( fragment_count > 1 )
+    {
+        PACKET_LOG_DBG("Payload size too big to be sent in a single frame %d, sent in %d fragments", frame_size, fragment_count);
+        tcu_uart_fragment_message_id++;
+    }
 
-        if( element.payload_size > APS_UNENCRYPTED_PAYLOAD_MAX)
+    // Split the payload into frames of up to APS_UNENCRYPTED_PAYLOAD_MAX bytes, copied straight
+    // from the RX frame ring into their slots of the APS output frame queue
+    for( uint8_t fragment_index = 0; fragment_index < fragment_count; fragment_index++ )
+    {
+        aps_output_frame_t *element = zigbee_aps_reserve_frame(APS_PRIORITY_DATA); // Space checked above
+        uint8_t data_size = (uint8_t)MIN(frame_size - offset, fragment_data_max);
+
+        element->dst_addr.addr_short = COORDINATOR_SHORT_ADDRESS;
+        element->cluster_id = cluster_id;
+        element->src_endpoint = DIGI_BINARY_VALUE_SOURCE_ENDPOINT;
+        element->dst_endpoint = DIGI_BINARY_VALUE_DESTINATION_ENDPOINT;
+        element->status_cb = tcu_uart_uplink_status_cb;
+        if( header_size )
+        {
+            element->payload[0] = tcu_uart_fragment_message_id;
+            element->payload[1] = fragment_index;
+            element->payload[2] = fragment_count;
+        }
+        memcpy(&element->payload[header_size], &frame[offset], data_size);
+        element->payload_size = header_size + data_size;
+        offset += data_size;
+
+        // Tracked before the status of the fragment can be reported. The whole TCU frame is accounted
+        // when its last fragment completes
+        k_spinlock_key_t key = k_spin_lock(&tcu_uart_uplink_lock);
+        zb_uint16_t handle = zigbee_aps_commit_frame(APS_PRIORITY_DATA);
+        if( handle != 0 )
         {
-            // TODO: send the payload in several frames
-            LOG_WRN("Payload size too big to be sent in a single frame %d", element.payload_size);
-            // Split the payload into multiple frames and send them sequentially
-            uint8_t remaining_payload_size = element.payload_size;
-            uint8_t offset = 0;
-            while (remaining_payload_size > 0)
+            if( fragment_index == 0 )
             {
-                // Calculate the payload size for this frame
-                if (remaining_payload_size > APS_UNENCRYPTED_PAYLOAD_MAX) 
-                {
-                    element.payload_size = APS_UNENCRYPTED_PAYLOAD_MAX;            
-                } 
-                else 
-                {
-                    element.payload_size = remaining_payload_size;            
-                }
-                // Copy the portion of the payload to the new frame
-                for( uint8_t i = 0; i < element.payload_size; i++ )
-                {
-                    element.payload[i] = tcu_uart_rx_buffer[offset + i];
-                }
-
-                LOG_WRN("Added new frame to buffer. Remaining payload size: %d", remaining_payload_size);
-                b_return = enqueue_aps_frame(&element);
-
-                // Update remaining_payload_size and offset
-                remaining_payload_size -= element.payload_size;
-                offset += element.payload_size;
+                tracked_frame = tcu_uart_uplink_track(handle, fragment_count, 1, frame_size, enqueue_time_ms, enqueue_time_ms);
             }
-            if (b_return) 
+            else if( tracked_frame != NULL )
             {
-                b_return = true;
+                tracked_frame->last_handle = handle;
             }
+            fragments_queued++;
         }
-        else
+        k_spin_unlock(&tcu_uart_uplink_lock, key);
+
+        b_return = ( handle != 0 );
+        if( !b_return ) break;
+    }
+
+    if( !b_return )
+    {
+        LOG_ERR("Frame could not be queued");
+        if( tracked_frame != NULL ) // The fragments not queued will never complete
         {
-            memcpy(element.payload, &tcu_uart_rx_buffer[0], element.payload_size);
-            if( enqueue_aps_frame(&element) ) b_return = true;
+            k_spinlock_key_t key = k_spin_lock(&tcu_uart_uplink_lock);
+            tracked_frame->b_failed = true;
+            tracked_frame->aps_frames_pending -= fragment_count - fragments_queued;
+            if( tracked_frame->aps_frames_pending == 0 ) tcu_uart_uplink_complete(tracked_frame);
+            k_spin_unlock(&tcu_uart_uplink_lock, key);
         }
     }
 
-    if( !b_return ) LOG_ERR("Not free space of aps output frame queue");
-
     return b_return;
 }
 
-/**@brief If a complete frame has been received from the TCU UART when the module is
- *        i transparente mode, place it in the APS output frame queue.
+#ifdef CONFIG_TCU_UART_UPLINK_BENCHMARK
+/**@brief Send the synthetic frames of the uplink benchmark through the same path as the frames
+ *        received from the TCU. The uplink statistics are reset at the start and printed when
+ *        the last frame has completed.
+ *
+ * @note Executed in the main loop.
+ */
+static void tcu_uart_uplink_benchmark(void)
+{
+    static uint8_t frame[CONFIG_TCU_UART_UPLINK_BENCHMARK_FRAME_SIZE];
+    static uint16_t frames_sent = 0;
+    static uint16_t frames_not_queued = 0;
+    static uint32_t time_last_frame_ms;
+    static bool b_finished = false;
+    uint32_t time_now_ms = k_uptime_get_32();
+
+    if( b_finished || !zb_zdo_joined() ) return;
+
+    if( frames_sent < CONFIG_TCU_UART_UPLINK_BENCHMARK_FRAMES )
+    {
+        if( frames_sent == 0 )
+        {
+            tcu_uart_uplink_statistics_t statistics;
+            tcu_uart_get_uplink_statistics(&statistics, true); // Start of the measurement window
+            for( uint16_t i = 0; i < sizeof(frame); i++ ) frame[i] = (uint8_t)i;
+            LOG_INF("Uplink benchmark: %d frames of %d bytes every %d ms", CONFIG_TCU_UART_UPLINK_BENCHMARK_FRAMES,
+                    CONFIG_TCU_UART_UPLINK_BENCHMARK_FRAME_SIZE, CONFIG_TCU_UART_UPLINK_BENCHMARK_PERIOD_MS);
+        }
+        else if( time_now_ms - time_last_frame_ms < CONFIG_TCU_UART_UPLINK_BENCHMARK_PERIOD_MS )
+        {
+            return;
+        }
+        time_last_frame_ms = time_now_ms;
+        frame[0] = (uint8_t)frames_sent;
+        if( !tcu_uart_send_received_frame_through_zigbee(frame, sizeof(frame)) ) frames_not_queued++;
+        frames_sent++;
+        return;
+    }
+
+    // Wait for the last frames to complete
+#ifdef CONFIG_TCU_UART_UPLINK_AGGREGATION
+    if( tcu_uart_aggregated_frame != NULL ) return;
+#endif
+    if( tcu_uart_uplink_frames_in_flight > 0 ) return;
+
+    b_finished = true;
+    LOG_INF("Uplink benchmark finished, %d frames could not be queued", frames_not_queued);
+    tcu_uart_log_uplink_statistics();
+}
+#endif
+
+#ifdef CONFIG_TCU_UART_ISR_STRESS
+/**@brief Allocate and release Zigbee stack buffers, then schedule itself again.
+ *
+ * @note Executed in the Zigbee thread.
+ */
+static void tcu_uart_isr_stress_buffers_cb(zb_uint8_t param)
+{
+    zb_bufid_t bufids[CONFIG_TCU_UART_ISR_STRESS_BUFFERS];
+    uint8_t allocated = 0;
+
+    ARG_UNUSED(param);
+    while( allocated < CONFIG_TCU_UART_ISR_STRESS_BUFFERS )
+    {
+        zb_bufid_t bufid = zb_buf_get_out();
+        if( !bufid ) break; // Pool exhausted, the uplink has priority
+        bufids[allocated++] = bufid;
+    }
+    while( allocated > 0 ) zigbee_aps_buf_free(bufids[--allocated]);
+
+    if( ZB_SCHEDULE_APP_ALARM(tcu_uart_isr_stress_buffers_cb, 0,
+                              ZB_MILLISECONDS_TO_BEACON_INTERVAL(CONFIG_TCU_UART_ISR_STRESS_BUFFER_PERIOD_MS)) != RET_OK )
+    {
+        LOG_ERR("Stress load: Zigbee buffer churn could not be scheduled");
+    }
+}
+
+/**@brief Keep the downlink queue busy with synthetic frames (TX wired to RX, so they are received
+ *        back) and start the Zigbee buffer churn once the device has joined the network.
+ *
+ * @note Executed in the main loop.
+ */
+static void tcu_uart_isr_stress(void)
+{
+    static uint8_t frame[CONFIG_TCU_UART_ISR_STRESS_FRAME_SIZE];
+    static bool b_started = false;
+    uint32_t tx_ring_used;
+
+    if( !zb_zdo_joined() ) return;
+
+    if( !b_started )
+    {
+        for( uint16_t i = 0; i < sizeof(frame); i++ ) frame[i] = (uint8_t)i; // Never "+++"
+        if( ZB_SCHEDULE_APP_CALLBACK(tcu_uart_isr_stress_buffers_cb, 0) != RET_OK ) return; // Retried in the next loop
+        b_started = true;
+        LOG_INF("Stress load: frames of %d bytes, %d Zigbee buffers every %d ms", CONFIG_TCU_UART_ISR_STRESS_FRAME_SIZE,
+                CONFIG_TCU_UART_ISR_STRESS_BUFFERS, CONFIG_TCU_UART_ISR_STRESS_BUFFER_PERIOD_MS);
+    }
+
+    // One frame waiting behind the one being transmitted, so the line never stays idle longer than t3.5
+    k_spinlock_key_t key = k_spin_lock(&tcu_uart_tx_lock);
+    tx_ring_used = ring_buf_size_get(&tcu_uart_tx_ring);
+    k_spin_unlock(&tcu_uart_tx_lock, key);
+    if( tx_ring_used <= sizeof(tcu_message_length_t) + sizeof(frame) ) queue_zigbee_Message(frame, sizeof(frame));
+}
+#endif
+
+/**@brief If complete frames have been received from the TCU UART when the module is
+ *        i transparente mode, place them in the APS output frame queue.
+ *        Frames are read in place from the RX frame ring and their slots released afterwards.
+ *        With CONFIG_TCU_UART_UPLINK_AGGREGATION the aggregated frame is also queued here when
+ *        its hold time has expired.
  *
  */
 void tcu_uart_transparent_mode_manager(void)
 {
-    if( b_tcu_uart_rx_complete_frame_received )
+    while( tcu_uart_rx_frames_tail != tcu_uart_rx_frames_head )
     {
+        tcu_uart_rx_frame_t *frame = &tcu_uart_rx_frames[tcu_uart_rx_frames_tail];
+        uint8_t next_tail = tcu_uart_rx_frames_tail + 1;
+        if( next_tail >= TCU_UART_RX_FRAME_SLOTS ) next_tail = 0;
+
         tcu_uart_frames_received_counter++;
-        tcu_uart_send_received_frame_through_zigbee();
-        b_tcu_uart_rx_complete_frame_received = false;
-        b_tcu_uart_rx_buffer_busy = false;
+        tcu_uart_send_received_frame_through_zigbee(frame->data, frame->size);
+        tcu_uart_rx_frames_tail = next_tail; // Give the slot back to the ISR
         //LOG_WRN("Frame received from TCU UART");
-    }   
+    }
+
+#ifdef CONFIG_TCU_UART_UPLINK_BENCHMARK
+    tcu_uart_uplink_benchmark();
+#endif
+
+#ifdef CONFIG_TCU_UART_ISR_STRESS
+    tcu_uart_isr_stress();
+#endif
+
+#ifdef CONFIG_TCU_UART_UPLINK_AGGREGATION
+    if( ( tcu_uart_aggregated_frame != NULL ) &&
+        ( k_uptime_get_32() - tcu_uart_aggregated_frame_start_ms >= CONFIG_TCU_UART_UPLINK_AGGREGATION_HOLD_MS ) )
+    {
+        tcu_uart_flush_aggregated_frame();
+    }
+#endif
 }
 
 //------------------------------------------------------------------------------
-/**@brief Management of tcu uart layer. Generation of TCU UART frames and scheduling of their transmission
- *
+/**@brief Handler of the APS frames received in the binary value cluster. In transparent mode their
+ *        payload is queued for transmission to the TCU.
  *
+ * @note Executed in the APS rx work queue.
  */
-void tcu_uart_manager(void)
+static void tcu_uart_binary_value_rx_handler(const zb_apsde_data_indication_t *ind, zb_uint8_t *payload, zb_uint16_t payload_size)
 {
-    if (!tcu_transmission_running)// && (uart_irq_tx_complete(dev_tcu_uart))) 
+    aps_frames_received_binary_cluster_counter++;
+
+    if( ( payload_size == 0 ) || ( payload_size >= UART_RX_BUFFER_SIZE ) )
     {
-        uint64_t current_time = k_uptime_get();
+        LOG_ERR("Payload of input RF packet is too big or too small: %d bytes", payload_size);
+        return;
+    }
+    PACKET_LOG_HEXDUMP_DBG(payload, payload_size, "Payload of input RF packet");
 
-        // If transmission just became idle, start counting idle time
-        if (uart_idle_start_time == 0) {
-            uart_idle_start_time = current_time;
+    if( !is_tcu_uart_in_command_mode() && ( payload_size >= MODBUS_MIN_RX_LENGTH ) )
+    {
+        if( queue_zigbee_Message(payload, payload_size) == 0 )
+        {
+            tcu_uart_frames_transmitted_counter++;
         }
-
-        // Calculate the idle duration in milliseconds
-        uart_idle_duration = current_time - uart_idle_start_time;
-
-        // You can also log or take action after a certain number of increments if needed
-        // For example, log a warning after 1000 iterations
-        if (uart_idle_duration  >= 80) {
-            int ret = k_msgq_get(&tcu_uart_tx_message_queue, &tcu_transmission_buffer, K_NO_WAIT);
-            if (ret == 0) {
-                //LOG_WRN("Sending message from queue");
-                //LOG_HEXDUMP_DBG((uint8_t *)tcu_transmission_buffer.buffer, tcu_transmission_buffer.size, "Payload of message from queue");
-                tcu_transmission_running = true;
-                // Reset the idle time tracking since transmission starts
-                uart_idle_start_time = 0;
-                uart_idle_duration = 0;
-                uart_idle_start_time = current_time;
-                uart_poll_out(dev_tcu_uart, tcu_transmission_buffer.buffer[0]);  // Send the first byte
-                tcu_transmission_buffer_index = 1;
-                uart_irq_tx_enable(dev_tcu_uart);  // Enable TX interrupt
-            }
+        else
+        {
+            LOG_ERR("Failed to send payload to TCU UART");
         }
     }
-}
\ No newline at end of file
+    else
+    {
+        tcu_uart_downlink_frames_discarded++; // Every downlink frame in command mode, so not logged
+        PACKET_LOG_DBG("Payload of input RF packet NOT sent to TCU UART: counter %d", tcu_uart_frames_transmitted_counter);
+    }
+}
+
+//------------------------------------------------------------------------------
+/**@brief Management of tcu uart layer. Transmissions are paced by the TX inter-frame gap timer,
+ *        so the main loop only has to retry the start in case a message was left in the queue.
+ *
+ */
+void tcu_uart_manager(void)
+{
+    tcu_uart_tx_start_next();
+}
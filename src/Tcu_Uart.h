@@ -6,21 +6,67 @@
 #ifndef TCU_UART_H_
 #define TCU_UART_H_
 
-/* Default tick to consider a modbus frame completed*/
-#define TICKS_TO_CONSIDER_FRAME_COMPLETED 10 // 10ms = approximately time for transmitting 20 chars at 19200
+/* Modbus RTU frame timing. Up to 19200 bps the end of frame silence (t3.5) is 3.5 character
+ * times; above that baud rate the specification uses a fixed value */
+#define MODBUS_RTU_FIXED_TIMING_BAUDRATE 19200
+#define MODBUS_RTU_FIXED_T35_US          1750
+
+/* Minimum silence left between two frames sent to the TCU. The gap actually used is the greater
+ * of this value and t3.5. Increase it if the TCU needs more time between requests */
+#define TCU_UART_TX_MIN_INTER_FRAME_GAP_US 0
 
 /*UART Modbus and zigbee buffer size definitions*/
 #define UART_RX_BUFFER_SIZE              255 //253 bytes + CRC (2 bytes) = 255
+#define TCU_UART_RX_FRAME_SLOTS          4   // Slots of the RX frame ring (up to SLOTS-1 completed frames pending + 1 being received)
+#define TCU_UART_TX_RING_SIZE            1024 // Bytes of the downlink message queue (each message uses its size + 2 bytes)
+
+#if defined(CONFIG_TCU_UART_UPLINK_FRAGMENTATION_STACK)
+#define TCU_UART_UPLINK_FRAGMENTATION_NAME "stack"
+#elif defined(CONFIG_TCU_UART_UPLINK_FRAGMENTATION_SEQUENCED)
+#define TCU_UART_UPLINK_FRAGMENTATION_NAME "sequenced"
+#else
+#define TCU_UART_UPLINK_FRAGMENTATION_NAME "raw"
+#endif
 
 
 #define MAXIMUM_SIZE_MODBUS_RTU_FRAME 256
+#define MODBUS_MIN_RX_LENGTH          8   // if the messagge has 8 bytes we consider it a modbus frame
 #define SIZE_TRANSMISSION_BUFFER MAXIMUM_SIZE_MODBUS_RTU_FRAME
 #define SIZE_OF_RX_FIFO_OF_NRF52840_UART 6
 
+/* Async (EasyDMA) backend, used when CONFIG_TCU_UART_ASYNC is enabled */
+#define TCU_UART_ASYNC_RX_BUFFER_COUNT   2  // DMA buffers chained by the driver (double buffering)
+#define TCU_UART_ASYNC_RX_BUFFER_SIZE    64 // A chunk is delivered when a buffer is full or after one character of silence
+
+/* Command mode. "+++" detection and AT command parsing run in a dedicated work queue */
+#define TCU_UART_CMD_MODE_GUARD_TIME_MS  500  // Silence needed before and after the "+++" sequence
+#define TCU_UART_CMD_MODE_TIMEOUT_MS     10000 // Silence after which the module leaves command mode
+#define TCU_UART_RX_EVENT_QUEUE_SIZE     64   // Bytes stored by the ISR for the command mode work queue
+#define TCU_UART_CMD_WORK_Q_STACK_SIZE   2048
+#define TCU_UART_CMD_WORK_Q_PRIORITY     5
+
+/* Statistics of the TCU UART interrupt, used with CONFIG_TCU_UART_ISR_STATS */
+typedef struct {
+    uint32_t overruns;            // RX overrun errors (bytes lost because the RX FIFO was full)
+    uint32_t rx_latency_samples;  // RX interrupts whose latency has been measured (interrupt driven backend only)
+    uint32_t max_rx_latency_ns;   // Worst delay from the RXDRDY event of a byte to the entry of the ISR (interrupt driven backend only)
+    uint32_t max_isr_duration_ns; // Longest execution of the ISR, or of the event handler with the async backend
+} tcu_uart_isr_stats_t;
+
+/* Statistics of the uplink, accounted per TCU frame: from the enqueue of its first APS frame to the
+ * delivery of the last one. Used to compare the fragmentation and aggregation modes */
+typedef struct {
+    uint32_t frames_delivered; // TCU frames whose APS frames were all delivered
+    uint32_t frames_failed;    // TCU frames with an APS frame not delivered
+    uint32_t bytes_delivered;  // TCU payload, without fragment headers or aggregation record lengths
+    uint32_t latency_sum_ms;
+    uint32_t latency_max_ms;
+    uint32_t busy_time_ms;     // Time with TCU frames in flight. The goodput does not include idle time
+} tcu_uart_uplink_statistics_t;
+
 /* States used to validate the "+++" sequence to enter in command mode        */
 enum
 {
-    ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_INITIAL_SILENCE_ST,
     ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_FIRST_CHAR_ST,
     ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_SECOND_CHAR_ST,
     ENTER_CMD_MODE_SEQUENCE_WAITING_FOR_THIRD_CHAR_ST,
@@ -31,25 +77,28 @@ enum
 int8_t tcu_uart_init(void);
 void tcu_uart_rx_buffer_init(void);
 int8_t tcu_uart_configuration(void);
-void tcu_uart_timers_10kHz(void);
+void tcu_uart_update_frame_timing(void);
 void tcu_uart_process_byte_received_in_command_mode(uint8_t input_byte);
 void tcu_uart_process_byte_received_in_transparent_mode(uint8_t input_byte);
+void tcu_uart_process_received_chunk(const uint8_t *data, size_t size);
 void tcu_uart_isr(const struct device *dev, void *user_data);
+void tcu_uart_tx_done(bool b_error);
+void tcu_uart_tx_start_next(void);
 void switch_tcu_uart_to_command_mode(void);
 void switch_tcu_uart_out_of_command_mode(void);
 bool is_tcu_uart_in_command_mode(void);
-void check_input_sequence_for_entering_in_command_mode(uint8_t input_byte);
-bool tcu_uart_send_received_frame_through_zigbee(void);
+void check_input_sequence_for_entering_in_command_mode(uint8_t input_byte, uint32_t silence_us, int64_t timestamp_ticks);
+bool tcu_uart_send_received_frame_through_zigbee(const uint8_t *frame, uint16_t frame_size);
 void tcu_uart_transparent_mode_manager(void);
 void tcu_uart_manager(void);
 int8_t queue_zigbee_Message(uint8_t *input_data, uint16_t size_input_data);
+uint32_t tcu_uart_get_tx_queue_high_water_mark(void);
+uint32_t tcu_uart_get_rx_events_dropped(void);
+void tcu_uart_get_rx_frames_discarded(uint32_t *ring_full, uint32_t *overflow);
+uint32_t tcu_uart_get_downlink_frames_discarded(void);
+void tcu_uart_get_uplink_statistics(tcu_uart_uplink_statistics_t *statistics, bool b_reset);
+void tcu_uart_log_uplink_statistics(void);
+void tcu_uart_get_isr_stats(tcu_uart_isr_stats_t *stats);
 
 extern uint8_t tcu_transmitted_frames_counter;
 #endif /* TCU_UART_H_ */
-
-
-
-
-
-
-
@@ -9,6 +9,23 @@
 #define MAXIMUM_SIZE_NODE_IDENTIFIER 20
 #define MAXIMUM_SIZE_LINK_KEY 32
 
+/* Diagnostics levels, selected with CONFIG_TCU_DIAGNOSTICS_LEVEL              */
+#define DIAGNOSTICS_LEVEL_NONE      0 // Only errors and warnings
+#define DIAGNOSTICS_LEVEL_SUMMARY   1 // Network info and counters printed once per minute
+#define DIAGNOSTICS_LEVEL_PACKET    2 // Logs and hexdumps of every frame of the data path
+
+#define DIAGNOSTICS_SUMMARY_ENABLED (CONFIG_TCU_DIAGNOSTICS_LEVEL >= DIAGNOSTICS_LEVEL_SUMMARY)
+
+/* Logs of every frame. Compiled out below DIAGNOSTICS_LEVEL_PACKET, so the payloads are not
+ * even copied to the log buffer */
+#if CONFIG_TCU_DIAGNOSTICS_LEVEL >= DIAGNOSTICS_LEVEL_PACKET
+#define PACKET_LOG_DBG(...)                           LOG_DBG(__VA_ARGS__)
+#define PACKET_LOG_HEXDUMP_DBG(data, length, string)  LOG_HEXDUMP_DBG(data, length, string)
+#else
+#define PACKET_LOG_DBG(...)                           do { } while (0)
+#define PACKET_LOG_HEXDUMP_DBG(data, length, string)  do { } while (0)
+#endif
+
 //Indicadores de alarma     
 extern bool g_b_flash_error;
 extern bool g_b_flash_write_cmd;
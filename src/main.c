@@ -27,9 +27,11 @@
 #include <zephyr/drivers/uart.h>
 #include <string.h>
 
-#include <nrfx_timer.h>
 #include <zephyr/drivers/hwinfo.h>
 #include <zephyr/sys/reboot.h>
+#ifdef CONFIG_TIMING_FUNCTIONS
+#include <zephyr/timing/timing.h>
+#endif
 
 #include "global_defines.h"
 #include "zigbee_configuration.h"
@@ -59,17 +61,16 @@
 /* Device endpoint, used to receive ZCL commands. */
 #define APP_TEMPLATE_ENDPOINT               232
 
-//#define ZB_APS_MAX_IN_FRAGMENT_TRANSMISSIONS 5U  // Example: Increase to handle 5 fragments in parallel
-//#define ZB_APS_ACK_WAIT_TIMEOUT             1000U // Example: Increase to 1000 ms
+/* ZB_APS_MAX_IN_FRAGMENT_TRANSMISSIONS and ZB_APS_ACK_WAIT_TIMEOUT belong to the build of the stack
+ * library and can not be changed here. With CONFIG_TCU_UART_UPLINK_FRAGMENTATION_STACK the window
+ * of fragmented frames is limited from zigbee_aps (APS_TX_FRAGMENTED_WINDOW_SIZE) */
 
 /* Type of power sources available for the device.
  * For possible values see section 3.2.2.2.8 of ZCL specification.
  */
 #define TEMPLATE_INIT_BASIC_POWER_SOURCE    ZB_ZCL_BASIC_POWER_SOURCE_DC_SOURCE
 
-/* Flag  used to print zigbee info once the device joins a network. */
-#define PRINT_ZIGBEE_INFO                ZB_TRUE
-#define PRINT_UART_INFO                  ZB_TRUE
+#define DEBUG_LED_TOGGLE_PERIOD_MS       1000
 
 /* The devicetree node identifier for the "led0" alias. */
 #define LED0_NODE DT_ALIAS(led0)
@@ -80,9 +81,6 @@
 #define WDT_NODE DT_INVALID_NODE
 #endif
 
-/*UART Modbus and zigbee buffer size definitions*/
-#define MODBUS_MIN_RX_LENGTH                8   // if the messagge has 8 bytes we consider it a modbus frame
-
 #define SIGNAL_STEERING_ATEMP_COUNT_MAX     3  // Number of steering attempts before local reset
 #define RESTART_ATEMP_COUNT_MAX             3  // Number of restart attempts before hardware reset
 
@@ -94,12 +92,11 @@ uint16_t aps_frames_received_commissioning_cluster_counter = 0;
 
 uint16_t tcu_uart_frames_transmitted_counter = 0;
 uint16_t tcu_uart_frames_received_counter = 0;
+uint16_t tcu_uart_frames_not_delivered_counter = 0;
 
 uint8_t soft_reset_counter = 0;
 uint8_t hard_reset_counter = 0;
 
-static volatile uint16_t debug_led_ms_x10 = 0; // 10000 ms timer to control the debug led
-
 bool g_b_flash_error = false; //   Flag to indicate if there was an error when reading the NVRAM
 
 /*
@@ -108,15 +105,12 @@ bool g_b_flash_error = false; //   Flag to indicate if there was an error when r
  */
 static const struct gpio_dt_spec led = GPIO_DT_SPEC_GET(LED0_NODE, gpios);
 
-// Get a reference to the TIMER1 instance
-static const nrfx_timer_t my_timer = NRFX_TIMER_INSTANCE(1);
-
 // Get reference to watchdog device
 static const struct device *const hw_wdt_dev = DEVICE_DT_GET_OR_NULL(WDT_NODE);
 int task_wdt_id;
 
 /* Zigbee messagge info*/
-static bool b_infit_info_flag = PRINT_ZIGBEE_INFO;
+static bool b_infit_info_flag = true;
 
 LOG_MODULE_REGISTER(main, LOG_LEVEL_DBG);
 
@@ -242,10 +236,7 @@ zb_uint8_t data_indication_cb(zb_bufid_t bufid)
         LOG_ERR("Buffer pool is out of memory!\n");
         if (bufid)
         {
-            // safe way to free buffer
-            zb_osif_disable_all_inter();
-            zb_buf_free(bufid);
-            zb_osif_enable_all_inter();
+            zigbee_aps_buf_free(bufid);
             g_b_reset_zigbee_cmd = true;
             return ZB_TRUE;
         }
@@ -253,126 +244,22 @@ zb_uint8_t data_indication_cb(zb_bufid_t bufid)
     else
 	{
         zb_apsde_data_indication_t *ind = ZB_BUF_GET_PARAM(bufid, zb_apsde_data_indication_t);  // Get APS header
-
-        zb_uint8_t *pointerToBeginOfBuffer;
-        zb_uint8_t *pointerToEndOfBuffer;
-        zb_int32_t sizeOfPayload;
-        pointerToBeginOfBuffer = zb_buf_begin(bufid);
-        pointerToEndOfBuffer = zb_buf_end(bufid);
-        sizeOfPayload = pointerToEndOfBuffer - pointerToBeginOfBuffer;
-
-        if(PRINT_ZIGBEE_INFO) {
-            LOG_DBG("Rx APS Frame with profile 0x%x, cluster 0x%x, src_ep %d, dest_ep %d, payload %d bytes, status %d",
-                                                    (uint16_t)ind->profileid, (uint16_t)ind->clusterid, (uint8_t)ind->src_endpoint,
-                                                    (uint8_t)ind->dst_endpoint, (uint16_t)sizeOfPayload, zb_buf_get_status(bufid));
-            ////LOG_DBG("  Rx APS Frame:\n");
-            //LOG_DBG("  Frame control (fc): %d\n", ind->fc);
-            ////LOG_DBG("  Destination address: 0x%04X\n", ind->dst_addr);
-            ////LOG_DBG("  Group address: 0x%04X\n", ind->group_addr);
-            //LOG_DBG("  APS counter: %d\n", ind->aps_counter);
-            ////LOG_DBG("  MAC source address: 0x%04X\n", ind->mac_src_addr);
-            ////LOG_DBG("  MAC destination address: 0x%04X\n", ind->mac_dst_addr);
-            ////LOG_DBG("  LQI: %d\n", ind->lqi);
-            ////LOG_DBG("  RSSI: %d\n", ind->rssi);
-            ////LOG_DBG("  APS key source: %d\n", ind->aps_key_source);
-            ////LOG_DBG("  APS key attributes: %d\n", ind->aps_key_attrs);
-            ////LOG_DBG("  APS key from TC: %d\n", ind->aps_key_from_tc);
-            //LOG_DBG("  Extended frame control: %d\n", ind->extended_fc);
-            //LOG_DBG("  Reserved: %d\n", ind->reserved);
-            //LOG_DBG("  Transaction sequence number (TSN): %d\n", ind->tsn);
-            //LOG_DBG("  Block number: %d\n", ind->block_num);
-            //LOG_DBG("  Block acknowledgment: %d\n", ind->block_ack);
-            ////LOG_DBG("  Radius: %d\n", ind->radius);
-            ////LOG_DBG("  Payload size: %d bytes\n", sizeOfPayload);
-            ////LOG_DBG("  Status: %d\n", zb_buf_get_status(bufid));
-        }
+        zb_uint8_t *payload = zb_buf_begin(bufid);
+        zb_uint16_t payload_size = (zb_uint16_t)zb_buf_len(bufid);
 
         aps_frames_received_total_counter++;
-        if( ind->clusterid == DIGI_BINARY_VALUE_CLUSTER )aps_frames_received_binary_cluster_counter++;
-        if( ind->clusterid == DIGI_COMMISSIONING_CLUSTER )aps_frames_received_commissioning_cluster_counter++;
 
-        if( (ind->clusterid == DIGI_BINARY_VALUE_CLUSTER) &&
-            ( ind->src_endpoint == DIGI_BINARY_VALUE_SOURCE_ENDPOINT ) &&
-            ( ind->dst_endpoint == DIGI_BINARY_VALUE_DESTINATION_ENDPOINT ) )
+        // Copied once and processed by the registered handler in the APS rx work queue, so the
+        // buffer is released without waiting for the application
+        if( !zigbee_aps_post_rx_frame(ind, payload, payload_size) )
         {
-            if ((sizeOfPayload > 0) && (sizeOfPayload < UART_RX_BUFFER_SIZE))
-            {
-                if(PRINT_ZIGBEE_INFO)
-                {
-                    LOG_DBG("Size of received payload is %d bytes \n", sizeOfPayload);
-                    LOG_HEXDUMP_DBG(pointerToBeginOfBuffer,sizeOfPayload,"Payload of input RF packet");
-                }
-                
-
-                if( !is_tcu_uart_in_command_mode() && (sizeOfPayload >= MODBUS_MIN_RX_LENGTH) )
-                {
-                    if (queue_zigbee_Message(pointerToBeginOfBuffer, sizeOfPayload) == SUCCESS) // Assuming queueMessage returns SUCCESS or error
-                    {
-                        tcu_uart_frames_transmitted_counter++;
-                        //if (PRINT_ZIGBEE_INFO) LOG_DBG("Payload of input RF packet sent to TCU UART: counter %d", tcu_uart_frames_transmitted_counter);
-                    }
-                    else
-                    {
-                        LOG_ERR("Failed to send payload to TCU UART");
-                    }                    
-                }
-                else
-                {
-                    if(PRINT_ZIGBEE_INFO) LOG_ERR("Payload of input RF packet NOT sent to TCU UART: counter %d", tcu_uart_frames_transmitted_counter);
-                }
-            }
-            else
-            {
-                if(PRINT_ZIGBEE_INFO) LOG_ERR("Payload of input RF packet is too big or too small: %d bytes", sizeOfPayload);
-            }
-        }
-
-        else if( ( ind->clusterid == DIGI_COMMISSIONING_CLUSTER ) &&
-            ( ind->src_endpoint == DIGI_COMMISSIONING_SOURCE_ENDPOINT ) &&
-            ( ind->dst_endpoint == DIGI_COMMISSIONING_DESTINATION_ENDPOINT ) )
-        {
-            if( is_a_digi_node_discovery_request((uint8_t *)pointerToBeginOfBuffer, (uint16_t)sizeOfPayload) )
-            {
-                if(PRINT_ZIGBEE_INFO) LOG_DBG("Xbee Node Discovery Device Request");
-            }
-        }
-        else if( ( ind->clusterid == DIGI_AT_COMMAND_CLUSTER ) &&
-            ( ind->src_endpoint == DIGI_AT_COMMAND_SOURCE_ENDPOINT ) &&
-            ( ind->dst_endpoint == DIGI_AT_COMMAND_DESTINATION_ENDPOINT ) )
-        {
-            if( is_a_digi_read_at_command((uint8_t *)pointerToBeginOfBuffer, (uint16_t)sizeOfPayload) )
-            {
-                if(PRINT_ZIGBEE_INFO) LOG_DBG("Xbee read AT command received");
-            }
-        }
-        else if( ( ind->clusterid == DIGI_AT_PING_CLUSTER ) &&
-            ( ind->src_endpoint == DIGI_AT_PING_SOURCE_ENDPOINT ) &&
-            ( ind->dst_endpoint == DIGI_AT_PING_DESTINATION_ENDPOINT ) )
-        {
-            if( is_a_ping_command((uint8_t *)pointerToBeginOfBuffer, (uint16_t)sizeOfPayload) )
-            {
-                if(PRINT_ZIGBEE_INFO) LOG_DBG("PING");
-            }
-        }
-        else
-        {
-            if(PRINT_ZIGBEE_INFO) LOG_ERR("Cluster ID not found");
-            if(PRINT_ZIGBEE_INFO) LOG_WRN("Rx APS Frame with profile 0x%x, cluster 0x%x, src_ep %d, dest_ep %d, payload %d bytes",
-                          (uint16_t)ind->profileid, (uint16_t)ind->clusterid, (uint8_t)ind->src_endpoint,(uint8_t)ind->dst_endpoint, (uint16_t)sizeOfPayload);
-            if(PRINT_ZIGBEE_INFO)
-                {
-                    LOG_DBG("Size of received payload is %d bytes \n", sizeOfPayload);
-                    LOG_HEXDUMP_DBG(pointerToBeginOfBuffer,sizeOfPayload,"Payload of input RF packet");
-                }
+            LOG_ERR("Rx APS Frame dropped: cluster 0x%x, payload %d bytes", (uint16_t)ind->clusterid, payload_size);
         }
 	}
 
     if (bufid)
     {
-    	// safe way to free buffer
-        zb_osif_disable_all_inter();
-        zb_buf_free(bufid);
-        zb_osif_enable_all_inter();
+        zigbee_aps_buf_free(bufid); // The payload has already been copied
     	return ZB_TRUE;
 	}
     LOG_ERR("Error: bufid is NULL data_indication_cb end");
@@ -396,7 +283,7 @@ void zboss_signal_handler(zb_bufid_t bufid)
         return;
     }
 
-    if( PRINT_ZIGBEE_INFO )
+    if( DIAGNOSTICS_SUMMARY_ENABLED )
     {
         if( sig != ZB_COMMON_SIGNAL_CAN_SLEEP ) // Do not show information about this one, it happens too often!
         {
@@ -426,7 +313,7 @@ void zboss_signal_handler(zb_bufid_t bufid)
         LOG_WRN("Device is encountering issues during steering. %d; counter %d", sig, soft_reset_counter);
         if (soft_reset_counter >= SIGNAL_STEERING_ATEMP_COUNT_MAX)
         {
- 			if(PRINT_ZIGBEE_INFO)
+ 			if(DIAGNOSTICS_SUMMARY_ENABLED)
  			{	
             	zb_uint16_t parnet_node = zb_nwk_get_parent();
                 if(parnet_node != 0xffff)
@@ -464,59 +351,10 @@ void zboss_signal_handler(zb_bufid_t bufid)
 	 */
 	if (bufid)
 	{
-		// safe way to free buffer
-        zb_osif_disable_all_inter();
-        zb_buf_free(bufid);
-        zb_osif_enable_all_inter();	
+        zigbee_aps_buf_free(bufid);
     }
 }
 
-// Interrupt handler for the timer
-// NOTE: This callback is triggered by an interrupt. Many drivers or modules in Zephyr can not be accessed directly from interrupts, 
-//		 and if you need to access one of these from the timer callback it is necessary to use something like a k_work item to move execution out of the interrupt context. 
-void timer1_event_handler(nrf_timer_event_t event_type, void * p_context)
-{
-	switch(event_type) {
-		case NRF_TIMER_EVENT_COMPARE0:
-            if(debug_led_ms_x10 < 10000) debug_led_ms_x10++;
-            tcu_uart_timers_10kHz();
-            check_scheduling_cb_timeout();
-			break;
-		default:
-			break;
-	}
-}
-
-// Function for scheduling repeated callbacks from TIMER1
-static void timer1_repeated_timer_start(uint32_t timeout_us)
-{
-	nrfx_timer_enable(&my_timer);
-
-	nrfx_timer_extended_compare(&my_timer, NRF_TIMER_CC_CHANNEL0, timeout_us, 
-                                NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, true);
-}
-
-// Function for initializing the TIMER1 peripheral using the nrfx driver
-static void timer1_init(void)
-{
-	//nrfx_timer_config_t timer_config = NRFX_TIMER_DEFAULT_CONFIG(NRF_TIMER_FREQ_1MHz);
-	nrfx_timer_config_t timer_config = NRFX_TIMER_DEFAULT_CONFIG(1000000);
-	timer_config.bit_width = NRF_TIMER_BIT_WIDTH_32;
-
-	int err = nrfx_timer_init(&my_timer, &timer_config, timer1_event_handler);
-	if (err != NRFX_SUCCESS) {
-		LOG_WRN("Error initializing timer: %x\n", err);
-	}
-
-	IRQ_DIRECT_CONNECT(TIMER1_IRQn, 0, nrfx_timer_1_irq_handler, 0);
-	irq_enable(TIMER1_IRQn);
-
-	// Setup TIMER1 to generate callbacks every second 1000000
-	// Setup TIMER1 to generate callbacks every 100ms 100000
-	timer1_repeated_timer_start(100); //100 us
-	//timer1_repeated_timer_start(200000); // 200 ms
-}
-
 //------------------------------------------------------------------------------
 /**@brief Function for initializing the GPIO pins.
  *        Currently, only one pin is initialized. Configured as output to drive a led.
@@ -635,9 +473,12 @@ void zigbee_configuration()
  */
 void diagnostic_toogle_pin()
 {
-    if(debug_led_ms_x10 >= 10000)
+    static int64_t time_last_toggle_ms = 0;
+    int64_t time_now_ms = k_uptime_get();
+
+    if( ( time_now_ms - time_last_toggle_ms ) >= DEBUG_LED_TOGGLE_PERIOD_MS )
     {
-        debug_led_ms_x10 = 0;
+        time_last_toggle_ms = time_now_ms;
         gpio_pin_toggle_dt(&led);
     }
 }
@@ -659,10 +500,10 @@ void diagnostic_zigbee_info()
     {
         b_infit_info_flag = ZB_FALSE;
         b_Zigbe_Connected = true;
-        if(PRINT_ZIGBEE_INFO) LOG_DBG("Zigbee application joined the network: bellow some info : \n");
+        if(DIAGNOSTICS_SUMMARY_ENABLED) LOG_DBG("Zigbee application joined the network: bellow some info : \n");
 
         xbee_parameters.at_my = zb_get_short_address();
-        if(PRINT_ZIGBEE_INFO) LOG_DBG("zigbee shrot addr:  0x%x\n", xbee_parameters.at_my);
+        if(DIAGNOSTICS_SUMMARY_ENABLED) LOG_DBG("zigbee shrot addr:  0x%x\n", xbee_parameters.at_my);
 
         zb_get_extended_pan_id(zb_ext_pan_id);
         
@@ -672,26 +513,26 @@ void diagnostic_zigbee_info()
         {
             temp[i] = zb_ext_pan_id[7-i];
         }
-        if(PRINT_ZIGBEE_INFO) LOG_HEXDUMP_DBG(temp,8,"Extended PAN ID: ");
+        if(DIAGNOSTICS_SUMMARY_ENABLED) LOG_HEXDUMP_DBG(temp,8,"Extended PAN ID: ");
 
         switch(zb_get_network_role())
         {
         case 0:
-            if(PRINT_ZIGBEE_INFO) LOG_DBG("zigbee role coordinator\n");
+            if(DIAGNOSTICS_SUMMARY_ENABLED) LOG_DBG("zigbee role coordinator\n");
             break;
         case 1:
-            if(PRINT_ZIGBEE_INFO) LOG_DBG("zigbee role router\n");
+            if(DIAGNOSTICS_SUMMARY_ENABLED) LOG_DBG("zigbee role router\n");
             break;
         case 2:
-            if(PRINT_ZIGBEE_INFO) LOG_DBG("zigbee role end device\n");
+            if(DIAGNOSTICS_SUMMARY_ENABLED) LOG_DBG("zigbee role end device\n");
             break;
         default:
-            if(PRINT_ZIGBEE_INFO) LOG_DBG("Zigbee role NOT found \n");
+            if(DIAGNOSTICS_SUMMARY_ENABLED) LOG_DBG("Zigbee role NOT found \n");
             break;
         }
 
     xbee_parameters.at_ch = zb_get_current_channel();
-    if(PRINT_ZIGBEE_INFO) LOG_DBG("zigbee channel: %d \n", xbee_parameters.at_ch);
+    if(DIAGNOSTICS_SUMMARY_ENABLED) LOG_DBG("zigbee channel: %d \n", xbee_parameters.at_ch);
 
     }
 }
@@ -770,13 +611,62 @@ void display_counters(void)
     if( (uint64_t)( time_now_ms - time_last_ms ) > 60000 )
     {
         time_last_ms = time_now_ms;
+#if DIAGNOSTICS_SUMMARY_ENABLED
         LOG_DBG("APS RX COUNTERS: Total %d, Binary %d, Commis %d",
                                aps_frames_received_total_counter,
                                aps_frames_received_binary_cluster_counter,
                                aps_frames_received_commissioning_cluster_counter);
-        LOG_DBG("Uart frames: Tx %d, Rx %d",
+        LOG_DBG("Uart frames: Tx %d, Rx %d, Rx not delivered %d",
                                tcu_uart_frames_transmitted_counter,
-                               tcu_uart_frames_received_counter);
+                               tcu_uart_frames_received_counter,
+                               tcu_uart_frames_not_delivered_counter);
+        LOG_DBG("APS RX frames dropped %d, without handler %d",
+                               zigbee_aps_get_rx_frames_dropped(),
+                               zigbee_aps_get_rx_frames_without_handler());
+#ifdef CONFIG_TCU_UART_ISR_STATS
+        tcu_uart_isr_stats_t tcu_uart_isr_stats;
+        tcu_uart_get_isr_stats(&tcu_uart_isr_stats);
+        LOG_DBG("Uart ISR: overruns %d, max RX latency %d ns (%d samples), max duration %d ns (interrupts masked by zb_buf_free %d)",
+                               tcu_uart_isr_stats.overruns,
+                               tcu_uart_isr_stats.max_rx_latency_ns,
+                               tcu_uart_isr_stats.rx_latency_samples,
+                               tcu_uart_isr_stats.max_isr_duration_ns,
+                               IS_ENABLED(CONFIG_ZIGBEE_BUF_FREE_MASK_INTERRUPTS));
+#endif
+        LOG_DBG("Uart TX queue: high water mark %d of %d bytes",
+                               tcu_uart_get_tx_queue_high_water_mark(),
+                               TCU_UART_TX_RING_SIZE);
+        LOG_DBG("Uart RX events dropped %d", tcu_uart_get_rx_events_dropped());
+        uint32_t rx_frames_discarded_ring_full;
+        uint32_t rx_frames_discarded_overflow;
+        tcu_uart_get_rx_frames_discarded(&rx_frames_discarded_ring_full, &rx_frames_discarded_overflow);
+        LOG_DBG("Uart RX frames discarded: all slots pending %d, too long %d",
+                               rx_frames_discarded_ring_full,
+                               rx_frames_discarded_overflow);
+        LOG_DBG("Downlink frames not sent to the TCU (command mode or too short) %d",
+                               tcu_uart_get_downlink_frames_discarded());
+
+        tcu_uart_log_uplink_statistics();
+#endif
+
+#ifdef CONFIG_TCU_DIAGNOSTICS_CYCLE_STATS
+        // Average cost of a frame in the data path. Compare builds with different diagnostics
+        // levels to measure the cycles saved by compiling out the per packet logs
+        aps_cycle_statistics_t aps_cycle_statistics;
+        zigbee_aps_get_cycle_statistics(&aps_cycle_statistics);
+        uint32_t rx_cycles_per_frame_x100 = aps_cycle_statistics.rx_frames ?
+                               (uint32_t)(aps_cycle_statistics.rx_cycles * 100 / aps_cycle_statistics.rx_frames) : 0;
+        uint32_t tx_cycles_per_frame_x100 = aps_cycle_statistics.tx_frames ?
+                               (uint32_t)(aps_cycle_statistics.tx_cycles * 100 / aps_cycle_statistics.tx_frames) : 0;
+        uint32_t rx_ns_per_frame = aps_cycle_statistics.rx_frames ?
+                               (uint32_t)(timing_cycles_to_ns(aps_cycle_statistics.rx_cycles) / aps_cycle_statistics.rx_frames) : 0;
+        uint32_t tx_ns_per_frame = aps_cycle_statistics.tx_frames ?
+                               (uint32_t)(timing_cycles_to_ns(aps_cycle_statistics.tx_cycles) / aps_cycle_statistics.tx_frames) : 0;
+        LOG_DBG("Cycles per frame (diagnostics level %d): RX %d frames, %d.%02d cycles (%d ns), TX %d frames, %d.%02d cycles (%d ns)",
+                               CONFIG_TCU_DIAGNOSTICS_LEVEL,
+                               aps_cycle_statistics.rx_frames, rx_cycles_per_frame_x100 / 100, rx_cycles_per_frame_x100 % 100, rx_ns_per_frame,
+                               aps_cycle_statistics.tx_frames, tx_cycles_per_frame_x100 / 100, tx_cycles_per_frame_x100 % 100, tx_ns_per_frame);
+#endif
 
         /* Create buffer to send LQI request */
         /*
@@ -867,9 +757,15 @@ int main(void)
 
     get_reset_reason();        // Read last reset reason
 
+#ifdef CONFIG_TIMING_FUNCTIONS
+    // Cycle counter shared by the data path cycle statistics and the TCU UART interrupt statistics
+    timing_init();
+    timing_start();
+#endif
     zigbee_aps_init();
     digi_at_init();
     digi_node_discovery_init();
+    digi_wireless_at_init();
 
     ret = watchdog_init();
     if( ret < 0)
@@ -883,9 +779,6 @@ int main(void)
         LOG_ERR("tcu_uart_init error %d", ret);
     }
 
-    // Initialize TIMER1
-    timer1_init();
-
     // Initialize GPIO
     ret = gpio_init();
     if( ret < 0)
@@ -903,13 +796,11 @@ int main(void)
 
     while(1)
     {
-        // run diagnostic functions
-        if(PRINT_ZIGBEE_INFO)
-        {
-            diagnostic_toogle_pin();
-            diagnostic_zigbee_info();
-            display_counters();
-        }
+        // run diagnostic functions. They also update the network parameters and supervise the
+        // Zigbee thread, so they run at every level; only their logs depend on it
+        diagnostic_toogle_pin();
+        diagnostic_zigbee_info();
+        display_counters();
 
 		task_wdt_feed(task_wdt_id); // Feed the watchdog
 
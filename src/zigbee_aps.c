@@ -8,20 +8,61 @@
  * @brief Generation and reception of APS frames.
  */
 
+#include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <string.h>
+#ifdef CONFIG_TCU_DIAGNOSTICS_CYCLE_STATS
+#include <zephyr/timing/timing.h>
+#endif
 
 #include <zboss_api.h>
 #include <zigbee/zigbee_error_handler.h>
 #include "zigbee_aps.h"
 #include "Digi_profile.h"
+#include "global_defines.h"
 
-#define SCHEDULING_CB_TIMEOUT_MS 50000 // Tiempo límite en milisegundos para enviar un frame APS
-#define SYSTEM_TICK_MS 1              // Tiempo de tick del sistema en milisegundos
+#define SCHEDULING_CB_TIMEOUT_MS 5000 // Tiempo límite en milisegundos para enviar un frame APS
 
 /* Local variables                                                            */
-static aps_output_frame_circular_buffer_t aps_output_frame_buffer;
-static bool b_scheduling_cb_pending = false;
-static uint32_t scheduling_cb_timer = 0;
+static uint8_t aps_control_frames[APS_CONTROL_FRAME_BUFFER_SIZE * APS_OUTPUT_FRAME_SLOT_SIZE(APS_CONTROL_FRAME_PAYLOAD_MAX)] __aligned(4);
+static uint8_t aps_data_frames[APS_DATA_FRAME_BUFFER_SIZE * APS_OUTPUT_FRAME_SLOT_SIZE(APS_FRAME_PAYLOAD_MAX)] __aligned(4);
+static aps_output_frame_circular_buffer_t aps_output_frame_buffer[APS_NUMBER_OF_PRIORITIES]; // One lane per priority
+static atomic_t scheduling_cb_pending = ATOMIC_INIT(0);
+static volatile uint8_t aps_frames_in_flight = 0; // Frames passed to the stack whose transmission has not completed yet
+static volatile bool b_aps_tx_backpressure = false; // Waiting for a stack buffer or for the end of a backoff
+static uint16_t aps_tx_backoff_ms = APS_TX_BACKOFF_MIN_MS;
+static zb_uint16_t aps_tx_next_handle = 1;
+#ifdef CONFIG_TCU_DIAGNOSTICS_CYCLE_STATS
+static aps_cycle_statistics_t aps_cycle_statistics;
+static struct k_spinlock aps_cycle_statistics_lock; // Updated in the APS rx work queue and the Zigbee thread
+#endif
+static aps_rx_handler_entry_t aps_rx_handlers[APS_RX_HANDLERS_MAX]; // Sorted by key
+static uint8_t aps_rx_handlers_count = 0;
+static uint32_t aps_rx_frames_dropped = 0; // Received frames lost because the pool was exhausted
+static uint32_t aps_rx_frames_without_handler = 0; // Received frames of a cluster without handler (APS rx work queue)
+
+/* Received frames are handed over from the Zigbee thread to the APS rx work queue */
+K_MEM_SLAB_DEFINE(aps_rx_frame_slab, sizeof(aps_rx_frame_t), APS_RX_FRAME_POOL_SIZE, 4);
+K_MSGQ_DEFINE(aps_rx_frame_queue, sizeof(aps_rx_frame_t *), APS_RX_FRAME_POOL_SIZE, 4);
+K_THREAD_STACK_DEFINE(aps_rx_work_q_stack, APS_RX_WORK_Q_STACK_SIZE);
+static struct k_work_q aps_rx_work_q;
+
+static void aps_rx_work_handler(struct k_work *work);
+K_WORK_DEFINE(aps_rx_work, aps_rx_work_handler);
+
+/* Frames passed to the stack, indexed by the buffer used to transmit them, so the transmission
+ * status can be reported to the producer of each frame */
+typedef struct {
+    zb_bufid_t bufid; // 0 if the entry is free
+    zb_uint16_t handle;
+    aps_tx_status_cb_t status_cb;
+    uint32_t enqueue_time_ms;
+} aps_tx_in_flight_t;
+
+static aps_tx_in_flight_t aps_tx_in_flight[APS_TX_WINDOW_SIZE];
+
+static void scheduling_cb_watchdog_expiry(struct k_timer *timer);
+K_TIMER_DEFINE(scheduling_cb_watchdog_timer, scheduling_cb_watchdog_expiry, NULL);
 
 LOG_MODULE_REGISTER(zigbee_aps, LOG_LEVEL_DBG);
 
@@ -34,44 +75,144 @@ LOG_MODULE_REGISTER(zigbee_aps, LOG_LEVEL_DBG);
  */
 void zigbee_aps_init(void)
 {
+    static const struct k_work_queue_config aps_rx_work_q_config = { .name = "aps_rx" };
+
     init_aps_output_frame_buffer();
+    k_work_queue_start(&aps_rx_work_q, aps_rx_work_q_stack, K_THREAD_STACK_SIZEOF(aps_rx_work_q_stack),
+                       APS_RX_WORK_Q_PRIORITY, &aps_rx_work_q_config);
 }
 
 //------------------------------------------------------------------------------
-/**@brief Initialization of aps output frame circular buffer.
+/**@brief Initialization of aps output frame circular buffer (all the priority lanes).
  *
  *
  */
 void init_aps_output_frame_buffer(void)
 {
-    aps_output_frame_buffer.head = 0;
-    aps_output_frame_buffer.tail = 0;
-    aps_output_frame_buffer.free_space = APS_OUTPUT_FRAME_BUFFER_SIZE;
-    aps_output_frame_buffer.used_space = 0;
+    aps_output_frame_buffer[APS_PRIORITY_CONTROL].data = aps_control_frames;
+    aps_output_frame_buffer[APS_PRIORITY_CONTROL].size = APS_CONTROL_FRAME_BUFFER_SIZE;
+    aps_output_frame_buffer[APS_PRIORITY_CONTROL].slot_size = APS_OUTPUT_FRAME_SLOT_SIZE(APS_CONTROL_FRAME_PAYLOAD_MAX);
+    aps_output_frame_buffer[APS_PRIORITY_CONTROL].payload_max = APS_CONTROL_FRAME_PAYLOAD_MAX;
+    aps_output_frame_buffer[APS_PRIORITY_DATA].data = aps_data_frames;
+    aps_output_frame_buffer[APS_PRIORITY_DATA].size = APS_DATA_FRAME_BUFFER_SIZE;
+    aps_output_frame_buffer[APS_PRIORITY_DATA].slot_size = APS_OUTPUT_FRAME_SLOT_SIZE(APS_FRAME_PAYLOAD_MAX);
+    aps_output_frame_buffer[APS_PRIORITY_DATA].payload_max = APS_FRAME_PAYLOAD_MAX;
+
+    for( uint8_t i = 0; i < APS_NUMBER_OF_PRIORITIES; i++ )
+    {
+        atomic_set(&aps_output_frame_buffer[i].head, 0);
+        atomic_set(&aps_output_frame_buffer[i].tail, 0);
+    }
+}
+
+//------------------------------------------------------------------------------
+/**@brief Number of frames stored in one lane of the aps output frame circular buffer.
+ *        Valid from both sides of the ring: the producer can only see fewer free positions and
+ *        the consumer fewer frames than there really are, never more.
+ */
+static uint16_t aps_lane_used_space(aps_output_frame_circular_buffer_t *lane)
+{
+    atomic_val_t head = atomic_get(&lane->head);
+    atomic_val_t tail = atomic_get(&lane->tail);
+
+    if( head >= tail ) return (uint16_t)(head - tail);
+    return (uint16_t)(head + 2 * lane->size - tail);
+}
+
+//------------------------------------------------------------------------------
+/**@brief Next value of a head or tail index, running over [0, 2 * size).
+ *
+ */
+static atomic_val_t aps_lane_next_index(aps_output_frame_circular_buffer_t *lane, atomic_val_t index)
+{
+    index++;
+    if( index >= 2 * lane->size ) index = 0;
+    return index;
+}
+
+//------------------------------------------------------------------------------
+/**@brief Slot of the lane pointed by a head or tail index.
+ *
+ */
+static aps_output_frame_t *aps_lane_slot(aps_output_frame_circular_buffer_t *lane, atomic_val_t index)
+{
+    if( index >= lane->size ) index -= lane->size;
+    return (aps_output_frame_t *)&lane->data[index * lane->slot_size];
+}
+
+//------------------------------------------------------------------------------
+/**@brief Return the number of frames waiting in the aps output frame circular buffer (all the lanes).
+ *
+ */
+static uint16_t pending_aps_frames(void)
+{
+    uint16_t pending = 0;
+
+    for( uint8_t i = 0; i < APS_NUMBER_OF_PRIORITIES; i++ )
+    {
+        pending += aps_lane_used_space(&aps_output_frame_buffer[i]);
+    }
+    return pending;
 }
 
 // -----------------------------------------------------------------------------
-/**@brief Function to get the free space of the aps output frame buffer.
+/**@brief Expiry function of the scheduling callback watchdog. The one-shot timer is armed when
+ *        the scheduling callback is requested, and again when the callback ends waiting for a
+ *        stack buffer or a backoff. It only expires if the callback, the buffer notification or
+ *        the backoff alarm never came, so the transmission would stall.
  *
- * @return  The free space of the aps output frame buffer.
+ * @note Executed in interrupt context.
  */
-void check_scheduling_cb_timeout(void)
+static void scheduling_cb_watchdog_expiry(struct k_timer *timer)
 {
-    if (b_scheduling_cb_pending && scheduling_cb_timer > 0)
+    ARG_UNUSED(timer);
+
+    if (atomic_cas(&scheduling_cb_pending, 1, 0))
     {
-        scheduling_cb_timer -= SYSTEM_TICK_MS; // Decrementa cada 10KHz
-        if (scheduling_cb_timer <= 0)
-        {
-            b_scheduling_cb_pending = false;
-            LOG_ERR("Scheduling callback flag reset after timeout");
-        }
+        LOG_ERR("Scheduling callback flag reset after timeout");
+    }
+    if (b_aps_tx_backpressure)
+    {
+        b_aps_tx_backpressure = false; // The main loop will schedule the transmission again
+        LOG_ERR("APS transmission backpressure reset after timeout");
     }
 }
 
+//------------------------------------------------------------------------------
+/**@brief Report the end of the transmission of a frame to its producer
+ *
+ */
+static void zigbee_aps_notify_tx_status(zb_uint16_t handle, aps_tx_status_cb_t status_cb, uint32_t enqueue_time_ms, zb_ret_t status)
+{
+    uint32_t latency_ms = k_uptime_get_32() - enqueue_time_ms;
+
+    PACKET_LOG_DBG("Transmission completed, handle = %d, status = %d, latency = %d ms", handle, status, latency_ms);
+    if( status_cb != NULL ) status_cb(handle, status, latency_ms);
+}
+
+//------------------------------------------------------------------------------
+/**@brief Release a buffer of the Zigbee stack.
+ *
+ * @details Buffers are released in the Zigbee thread, so interrupts do not need to be masked.
+ *          CONFIG_ZIGBEE_BUF_FREE_MASK_INTERRUPTS restores the masking used before, so its effect
+ *          on the TCU UART interrupt can be measured with the same build.
+ *
+ * @param   bufid   Reference to the buffer
+ */
+void zigbee_aps_buf_free(zb_bufid_t bufid)
+{
+#ifdef CONFIG_ZIGBEE_BUF_FREE_MASK_INTERRUPTS
+    zb_osif_disable_all_inter();
+    zb_buf_free(bufid);
+    zb_osif_enable_all_inter();
+#else
+    zb_buf_free(bufid);
+#endif
+}
+
 //------------------------------------------------------------------------------
 /**@brief Callback function executed when APS frame transmission is completed.
- *        The buffer is released.
- *        A log message showing APS, NWK and MAC counters is printed.
+ *        The status of the transmission is reported to the producer of the frame and the buffer is released.
  *
  * @param   bufid   Reference to the Zigbee stack buffer used to transmit the APS frame
  *
@@ -88,177 +229,440 @@ void zigbee_aps_user_data_tx_cb(zb_bufid_t bufid)
 {
     if( bufid )
     {
-        zb_uint8_t *pointerToBeginOfBuffer;
-        zb_uint8_t aps_counter;
-        zb_uint8_t nwk_sequence_number;
-        zb_uint8_t mac_sequence_number;
-
-        pointerToBeginOfBuffer = zb_buf_begin(bufid);
-        pointerToBeginOfBuffer = pointerToBeginOfBuffer - 17;
-
-        mac_sequence_number = pointerToBeginOfBuffer[2];
-        nwk_sequence_number = pointerToBeginOfBuffer[16];
-        aps_counter = pointerToBeginOfBuffer[24];
-        LOG_DBG("Transmission completed, MAC seq = %d, NWK seq = %d, APS counter = %d", mac_sequence_number, nwk_sequence_number, aps_counter);
-
-        // safe way to free buffer
-        zb_osif_disable_all_inter();
-        zb_buf_free(bufid);
-        zb_osif_enable_all_inter();
+        for( uint8_t i = 0; i < APS_TX_WINDOW_SIZE; i++ )
+        {
+            if( aps_tx_in_flight[i].bufid == bufid )
+            {
+                aps_tx_in_flight[i].bufid = 0;
+                // A place in the transmission window has been released
+                if( aps_frames_in_flight > 0 ) aps_frames_in_flight--;
+                zigbee_aps_notify_tx_status(aps_tx_in_flight[i].handle, aps_tx_in_flight[i].status_cb,
+                                            aps_tx_in_flight[i].enqueue_time_ms, zb_buf_get_status(bufid));
+                break;
+            }
+        }
+
+        zigbee_aps_buf_free(bufid);
+    }
+
+    zigbee_aps_schedule_transmission();
+}
+
+//------------------------------------------------------------------------------
+/**@brief Reserve the next free slot of one lane of the circular buffer used to store pending aps
+ *        output frames, so the producer can build the frame in place.
+ *        The frame is not visible to the scheduler until zigbee_aps_commit_frame is called.
+ *        Only one slot per lane can be reserved at a time.
+ *
+ * @param  priority Lane where the frame will be added (enum aps_priority_e)
+ *
+ * @retval NULL The lane is full
+ * @retval Pointer to the slot. The producer sets dst_addr, cluster_id, endpoints, status_cb,
+ *         payload and payload_size.
+ */
+aps_output_frame_t *zigbee_aps_reserve_frame(uint8_t priority)
+{
+    aps_output_frame_circular_buffer_t *lane;
+
+    if( priority >= APS_NUMBER_OF_PRIORITIES )
+    {
+        LOG_ERR("Wrong priority of aps output frame %d", priority);
+        return NULL;
     }
+    lane = &aps_output_frame_buffer[priority];
+
+    if( aps_lane_used_space(lane) >= lane->size ) return NULL;
+    return aps_lane_slot(lane, atomic_get(&lane->head));
 }
 
 //------------------------------------------------------------------------------
-/**@brief Add new element to circular buffer used to store pending aps output frames.
+/**@brief Add to the circular buffer the frame built in the slot returned by zigbee_aps_reserve_frame.
  *
- * @param  element Pointer to struct containing new element to be added
+ * @param  priority Lane of the reserved slot (enum aps_priority_e)
  *
- * @retval true The new element could be added
- * @retval false The new element could not be added (buffer is full or size of payload too big)
+ * @retval 0 The frame could not be added (lane is full or size of payload too big)
+ * @retval Handle assigned to the frame, passed to its status_cb
  */
-bool enqueue_aps_frame(aps_output_frame_t *element)
+zb_uint16_t zigbee_aps_commit_frame(uint8_t priority)
 {
-    if( aps_output_frame_buffer.free_space > 0 )
+    aps_output_frame_circular_buffer_t *lane;
+    aps_output_frame_t *slot = zigbee_aps_reserve_frame(priority);
+
+    if( slot == NULL )
     {
-        if( element->payload_size <= APS_UNENCRYPTED_PAYLOAD_MAX )
-        {
-            aps_output_frame_buffer.data[aps_output_frame_buffer.head].dst_addr = element->dst_addr;
-            aps_output_frame_buffer.data[aps_output_frame_buffer.head].cluster_id = element->cluster_id;
-            aps_output_frame_buffer.data[aps_output_frame_buffer.head].dst_endpoint = element->dst_endpoint;
-            aps_output_frame_buffer.data[aps_output_frame_buffer.head].src_endpoint = element->src_endpoint;
-            aps_output_frame_buffer.data[aps_output_frame_buffer.head].payload_size = element->payload_size;            
-            for( uint8_t i = 0; i < element->payload_size; i++ )
-            {
-                aps_output_frame_buffer.data[aps_output_frame_buffer.head].payload[i] = element->payload[i];
-            }
-            aps_output_frame_buffer.head = aps_output_frame_buffer.head + 1;
-            if( aps_output_frame_buffer.head >= APS_OUTPUT_FRAME_BUFFER_SIZE ) aps_output_frame_buffer.head = 0;
-            aps_output_frame_buffer.used_space = aps_output_frame_buffer.used_space + 1;
-            aps_output_frame_buffer.free_space = aps_output_frame_buffer.free_space - 1;
-            return true;
-        }
-        else
-        {
-            LOG_ERR("Payload size too big to be sent in a single frame %d", element->payload_size);
-            return false;
-        }
+        LOG_ERR("Not free space of aps output frame queue (priority %d)", priority);
+        return 0;
     }
-    else
+    lane = &aps_output_frame_buffer[priority];
+    if( slot->payload_size > lane->payload_max )
     {
-        LOG_ERR("Not free space of aps output frame queue");
-        return false;
+        LOG_ERR("Payload size too big for the slots of the lane %d (priority %d)", slot->payload_size, priority);
+        return 0;
     }
+
+    slot->retries = 0;
+    slot->handle = aps_tx_next_handle++;
+    if( aps_tx_next_handle == 0 ) aps_tx_next_handle = 1; // 0 is never used as handle
+    slot->enqueue_time_ms = k_uptime_get_32();
+
+    // Publish the frame. atomic_set is a full barrier, the slot is written before the consumer can see it
+    atomic_set(&lane->head, aps_lane_next_index(lane, atomic_get(&lane->head)));
+    return slot->handle;
 }
 
 //------------------------------------------------------------------------------
-/**@brief extract element from circular buffer used to store pending aps output frames.
+/**@brief Get the next element to be transmitted from the circular buffer used to store pending
+ *        aps output frames, without extracting it. The element stays valid until it is released
+ *        with discard_aps_frame.
  *
- * @param   element Pointer to struct where extracted element will be stored.
+ * @param  priority Output, lane of the element, to be passed to discard_aps_frame
  *
- * @retval true The element could be extracted.
- * @retval false The new element could not be extracted (buffer is empty).
+ * @retval NULL The buffer is empty
+ * @retval Pointer to the first element of the non-empty lane with the highest priority
  */
-bool dequeue_aps_frame(aps_output_frame_t *element)
+static aps_output_frame_t *peek_aps_frame(uint8_t *priority)
 {
-    if( aps_output_frame_buffer.used_space > 0 )
+    for( uint8_t i = 0; i < APS_NUMBER_OF_PRIORITIES; i++ )
     {
-        element->dst_addr = aps_output_frame_buffer.data[aps_output_frame_buffer.tail].dst_addr;
-        element->cluster_id = aps_output_frame_buffer.data[aps_output_frame_buffer.tail].cluster_id;
-        element->dst_endpoint = aps_output_frame_buffer.data[aps_output_frame_buffer.tail].dst_endpoint;
-        element->src_endpoint = aps_output_frame_buffer.data[aps_output_frame_buffer.tail].src_endpoint;
-        element->payload_size = aps_output_frame_buffer.data[aps_output_frame_buffer.tail].payload_size;
-        if( element->payload_size > APS_UNENCRYPTED_PAYLOAD_MAX ) element->payload_size = APS_UNENCRYPTED_PAYLOAD_MAX;
-        for( uint8_t i = 0; i < element->payload_size; i++ )
+        aps_output_frame_circular_buffer_t *lane = &aps_output_frame_buffer[i];
+
+        if( aps_lane_used_space(lane) > 0 )
         {
-            element->payload[i] = aps_output_frame_buffer.data[aps_output_frame_buffer.tail].payload[i];
+            *priority = i;
+            return aps_lane_slot(lane, atomic_get(&lane->tail));
         }
-        aps_output_frame_buffer.tail = aps_output_frame_buffer.tail + 1;
-        if( aps_output_frame_buffer.tail >= APS_OUTPUT_FRAME_BUFFER_SIZE ) aps_output_frame_buffer.tail = 0;
-        aps_output_frame_buffer.used_space = aps_output_frame_buffer.used_space - 1;
-        aps_output_frame_buffer.free_space = aps_output_frame_buffer.free_space + 1;
-        return true;
     }
-    else
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+/**@brief Release the first element of one lane of the circular buffer used to store pending aps
+ *        output frames (the element returned by peek_aps_frame).
+ *
+ * @param  priority Lane of the element
+ */
+static void discard_aps_frame(uint8_t priority)
+{
+    aps_output_frame_circular_buffer_t *lane = &aps_output_frame_buffer[priority];
+
+    // The slot is not reused by the producer until the new tail is visible
+    if( aps_lane_used_space(lane) > 0 ) atomic_set(&lane->tail, aps_lane_next_index(lane, atomic_get(&lane->tail)));
+}
+
+//------------------------------------------------------------------------------
+/**@brief Return the number of free positions on one lane of the aps output frame circular buffer.
+ *
+ * @param  priority Lane (enum aps_priority_e)
+ *
+ * @retval Number of free positions on the lane.
+ */
+uint16_t zigbee_aps_get_output_frame_buffer_free_space(uint8_t priority)
+{
+    if( priority >= APS_NUMBER_OF_PRIORITIES ) return 0;
+    return aps_output_frame_buffer[priority].size - aps_lane_used_space(&aps_output_frame_buffer[priority]);
+}
+
+//------------------------------------------------------------------------------
+/**@brief Number of APS frames passed to the stack whose transmission has not completed yet
+ *
+ */
+uint8_t zigbee_aps_get_frames_in_flight(void)
+{
+    return aps_frames_in_flight;
+}
+
+//------------------------------------------------------------------------------
+/**@brief Copy of the CPU cycles spent in the data path since the start up
+ *
+ * @note All zero below DIAGNOSTICS_LEVEL_SUMMARY, where they are not measured
+ */
+void zigbee_aps_get_cycle_statistics(aps_cycle_statistics_t *statistics)
+{
+#ifdef CONFIG_TCU_DIAGNOSTICS_CYCLE_STATS
+    k_spinlock_key_t key = k_spin_lock(&aps_cycle_statistics_lock);
+    *statistics = aps_cycle_statistics;
+    k_spin_unlock(&aps_cycle_statistics_lock, key);
+#else
+    memset(statistics, 0, sizeof(*statistics));
+#endif
+}
+
+//------------------------------------------------------------------------------
+/**@brief Key of the table of handlers of received APS frames
+ *
+ */
+static uint64_t zigbee_aps_rx_handler_key(zb_uint16_t profile_id, zb_uint16_t cluster_id, zb_uint8_t src_endpoint, zb_uint8_t dst_endpoint)
+{
+    return ( (uint64_t)profile_id << 32 ) | ( (uint64_t)cluster_id << 16 ) | ( (uint64_t)src_endpoint << 8 ) | dst_endpoint;
+}
+
+//------------------------------------------------------------------------------
+/**@brief Register the function that processes the APS frames received with a given profile,
+ *        cluster and endpoints. Modules register their handlers during initialization.
+ *
+ * @retval true The handler was registered
+ * @retval false The table is full or there is already a handler for that combination
+ */
+bool zigbee_aps_register_rx_handler(zb_uint16_t profile_id, zb_uint16_t cluster_id, zb_uint8_t src_endpoint,
+                                    zb_uint8_t dst_endpoint, aps_rx_handler_t handler)
+{
+    uint64_t key = zigbee_aps_rx_handler_key(profile_id, cluster_id, src_endpoint, dst_endpoint);
+    uint8_t position = 0;
+
+    if( aps_rx_handlers_count >= APS_RX_HANDLERS_MAX )
     {
+        LOG_ERR("Not free space in the table of APS rx handlers");
         return false;
     }
+
+    while( ( position < aps_rx_handlers_count ) && ( aps_rx_handlers[position].key < key ) ) position++;
+    if( ( position < aps_rx_handlers_count ) && ( aps_rx_handlers[position].key == key ) )
+    {
+        LOG_ERR("APS rx handler of cluster 0x%x already registered", cluster_id);
+        return false;
+    }
+
+    // Keep the table sorted
+    memmove(&aps_rx_handlers[position + 1], &aps_rx_handlers[position], ( aps_rx_handlers_count - position ) * sizeof(aps_rx_handler_entry_t));
+    aps_rx_handlers[position].key = key;
+    aps_rx_handlers[position].handler = handler;
+    aps_rx_handlers_count++;
+    return true;
 }
 
 //------------------------------------------------------------------------------
-/**@brief Return the number of free positions on the aps output frame circular buffer.
+/**@brief Pass a received APS frame to the handler registered for its profile, cluster and endpoints
+ *        (binary search in the table of handlers).
  *
- * @retval Number of free positions on the aps output frame circular buffer.
+ * @retval true The frame has been processed by its handler
+ * @retval false There is not a handler for the frame
  */
-uint16_t zigbee_aps_get_output_frame_buffer_free_space(void)
+bool zigbee_aps_dispatch_rx_frame(const zb_apsde_data_indication_t *ind, zb_uint8_t *payload, zb_uint16_t payload_size)
 {
-    return aps_output_frame_buffer.free_space;
+    uint64_t key = zigbee_aps_rx_handler_key(ind->profileid, ind->clusterid, ind->src_endpoint, ind->dst_endpoint);
+    uint8_t low = 0;
+    uint8_t high = aps_rx_handlers_count;
+
+    while( low < high )
+    {
+        uint8_t middle = ( low + high ) / 2;
+
+        if( aps_rx_handlers[middle].key == key )
+        {
+            aps_rx_handlers[middle].handler(ind, payload, payload_size);
+            return true;
+        }
+        if( aps_rx_handlers[middle].key < key ) low = middle + 1;
+        else high = middle;
+    }
+    return false;
 }
 
 //------------------------------------------------------------------------------
-/**@brief Generation and scheduling on the first APS frame of the queue
- *
+/**@brief Alarm executed at the end of a transmission backoff
  *
  */
-void zigbee_aps_frame_scheduling_cb(zb_uint8_t param)
+static void zigbee_aps_backoff_alarm_cb(zb_uint8_t param)
 {
     ZVUNUSED(param);
-    zb_ret_t zb_err_code;
+    b_aps_tx_backpressure = false;
+    zigbee_aps_schedule_transmission();
+}
 
-    if (zb_buf_is_oom_state()) {
-        // Handle Out Of Memory state
-        LOG_ERR("Buffer pool is out of memory!\n");
-        return;
+//------------------------------------------------------------------------------
+/**@brief The stack can not accept more frames now. Retry after a backoff that doubles on every
+ *        consecutive attempt, up to APS_TX_BACKOFF_MAX_MS. The attempt is counted on the first
+ *        frame of the queue, which is dropped after APS_TX_MAX_RETRIES attempts.
+ *
+ * @note Executed in the Zigbee thread.
+ */
+static void zigbee_aps_backoff(void)
+{
+    uint8_t priority;
+    aps_output_frame_t *frame = peek_aps_frame(&priority);
+
+    if( frame != NULL )
+    {
+        frame->retries++;
+        if( frame->retries > APS_TX_MAX_RETRIES )
+        {
+            LOG_ERR("APS frame with cluster 0x%x dropped after %d retries", frame->cluster_id, APS_TX_MAX_RETRIES);
+            zigbee_aps_notify_tx_status(frame->handle, frame->status_cb, frame->enqueue_time_ms, RET_NO_MEMORY);
+            discard_aps_frame(priority);
+        }
+    }
+
+    b_aps_tx_backpressure = true;
+    if( ZB_SCHEDULE_APP_ALARM(zigbee_aps_backoff_alarm_cb, 0, ZB_MILLISECONDS_TO_BEACON_INTERVAL(aps_tx_backoff_ms)) == RET_OK )
+    {
+        LOG_WRN("APS transmission retried in %d ms", aps_tx_backoff_ms);
+        aps_tx_backoff_ms = MIN(aps_tx_backoff_ms * 2, APS_TX_BACKOFF_MAX_MS);
     }
-    if (zb_buf_memory_low()) 
+    else
     {
-        // Handle low memory state
-        LOG_WRN("Warning: Buffer pool memory is running low!\n");
-        return;
+        LOG_ERR("APS transmission backoff could not be scheduled");
+        b_aps_tx_backpressure = false; // The main loop will try again
     }
+}
+
+//------------------------------------------------------------------------------
+/**@brief Generation and scheduling of the first APS frames of the queue.
+ *        Up to APS_TX_FRAMES_PER_CALLBACK frames are passed to the stack in each call, as long as
+ *        the number of frames in flight does not exceed APS_TX_WINDOW_SIZE.
+ *        When the stack runs out of buffers the transmission is retried with a backoff, or when
+ *        a buffer becomes available (zb_buf_get_out_delayed).
+ *
+ * @param   param   Buffer allocated by zb_buf_get_out_delayed, or 0 when no buffer is provided
+ */
+void zigbee_aps_frame_scheduling_cb(zb_uint8_t param)
+{
+    zb_bufid_t bufid = param;
+    uint8_t frames_scheduled = 0;
+
+    if( bufid ) b_aps_tx_backpressure = false; // The buffer we were waiting for
 
     // Trace the buffer statistics for debugging purposes
     zb_buf_oom_trace();
 
-    zb_bufid_t bufid = zb_buf_get_out();
-
-    if( bufid ) // If buffer could be allocated, generate frame and schedule the transmission
+    while( ( frames_scheduled < APS_TX_FRAMES_PER_CALLBACK ) &&
+           ( aps_frames_in_flight < APS_TX_WINDOW_SIZE ) )
     {
-        aps_output_frame_t aps_frame;
-        if( dequeue_aps_frame(&aps_frame) ) // First pending frame from the queue
+        // First pending frame, sent straight from its slot in the queue
+        uint8_t priority;
+        aps_output_frame_t *aps_frame = peek_aps_frame(&priority);
+        if( aps_frame == NULL ) break;
+#ifdef CONFIG_TCU_DIAGNOSTICS_CYCLE_STATS
+        timing_t frame_start = timing_counter_get();
+#endif
+
+        // The stack sends the fragments of a big frame with its own window, do not compete with it
+        if( ( aps_frame->payload_size > APS_UNENCRYPTED_PAYLOAD_MAX ) &&
+            ( aps_frames_in_flight >= APS_TX_FRAGMENTED_WINDOW_SIZE ) ) break;
+
+        if( !bufid )
         {
-            zb_ret_t ret = zb_aps_send_user_payload(bufid,
-                                                    aps_frame.dst_addr,
-                                                    DIGI_PROFILE_ID,
-                                                    aps_frame.cluster_id,
-                                                    aps_frame.src_endpoint,
-                                                    aps_frame.dst_endpoint,
-                                                    ZB_APS_ADDR_MODE_16_ENDP_PRESENT,
-                                                    ZB_TRUE,
-                                                    aps_frame.payload,
-                                                    aps_frame.payload_size);
-            if(ret == RET_OK) LOG_WRN("Scheduled APS Frame with cluster 0x%x and payload %d bytes", aps_frame.cluster_id, (uint16_t)aps_frame.payload_size);
-            else if(ret == RET_INVALID_PARAMETER_1) LOG_ERR("Transmission could not be scheduled: The buffer is invalid");
-            else if(ret == RET_INVALID_PARAMETER_2) LOG_ERR("Transmission could not be scheduled: The payload_ptr parameter is invalid");
-            else if(ret == RET_INVALID_PARAMETER_3) LOG_ERR("Transmission could not be scheduled: The payload_size parameter is too large");
-            else LOG_ERR("Transmission could not be scheduled: Unkown error");                                                    
+            if (zb_buf_is_oom_state()) {
+                // Handle Out Of Memory state
+                LOG_ERR("Buffer pool is out of memory!\n");
+                zigbee_aps_backoff();
+                break;
+            }
+            if (zb_buf_memory_low()) 
+            {
+                // Handle low memory state
+                LOG_WRN("Warning: Buffer pool memory is running low!\n");
+                zigbee_aps_backoff();
+                break;
+            }
+
+            bufid = zb_buf_get_out();
+            if( !bufid )
+            {
+                // Be notified when a buffer is available. Use the backoff if it can not be requested
+                if( zb_buf_get_out_delayed(zigbee_aps_frame_scheduling_cb) == RET_OK )
+                {
+                    b_aps_tx_backpressure = true;
+                    LOG_WRN("Transmission delayed: waiting for a Zigbee Out buffer");
+                }
+                else
+                {
+                    zigbee_aps_backoff();
+                }
+                break;
+            }
+        }
+
+        zb_ret_t ret = zb_aps_send_user_payload(bufid,
+                                                aps_frame->dst_addr,
+                                                DIGI_PROFILE_ID,
+                                                aps_frame->cluster_id,
+                                                aps_frame->src_endpoint,
+                                                aps_frame->dst_endpoint,
+                                                ZB_APS_ADDR_MODE_16_ENDP_PRESENT,
+                                                ZB_TRUE,
+                                                aps_frame->payload,
+                                                aps_frame->payload_size);
+        if(ret == RET_OK)
+        {
+            for( uint8_t i = 0; i < APS_TX_WINDOW_SIZE; i++ )
+            {
+                if( aps_tx_in_flight[i].bufid == 0 )
+                {
+                    aps_tx_in_flight[i].bufid = bufid;
+                    aps_tx_in_flight[i].handle = aps_frame->handle;
+                    aps_tx_in_flight[i].status_cb = aps_frame->status_cb;
+                    aps_tx_in_flight[i].enqueue_time_ms = aps_frame->enqueue_time_ms;
+                    break;
+                }
+            }
+            aps_frames_in_flight++;
+            frames_scheduled++;
+            aps_tx_backoff_ms = APS_TX_BACKOFF_MIN_MS;
+            PACKET_LOG_DBG("Scheduled APS Frame with cluster 0x%x and payload %d bytes", aps_frame->cluster_id, (uint16_t)aps_frame->payload_size);
         }
         else
         {
-            zb_osif_disable_all_inter();
-            zb_buf_free(bufid); // No need to use the buffer is there was not a pending frame in the queue.
-            zb_osif_enable_all_inter();
-            LOG_ERR("Transmission could not be scheduled: No pending output frame in queue");
-        }                
+            if(ret == RET_INVALID_PARAMETER_1) LOG_ERR("Transmission could not be scheduled: The buffer is invalid");
+            else if(ret == RET_INVALID_PARAMETER_2) LOG_ERR("Transmission could not be scheduled: The payload_ptr parameter is invalid");
+            else if(ret == RET_INVALID_PARAMETER_3) LOG_ERR("Transmission could not be scheduled: The payload_size parameter is too large");
+            else LOG_ERR("Transmission could not be scheduled: Unkown error");
+            zigbee_aps_notify_tx_status(aps_frame->handle, aps_frame->status_cb, aps_frame->enqueue_time_ms, ret);
+            // The transmission callback will not be executed for this buffer
+            zigbee_aps_buf_free(bufid);
+        }
+        discard_aps_frame(priority); // The stack has its own copy of the payload
+        bufid = 0;
+#ifdef CONFIG_TCU_DIAGNOSTICS_CYCLE_STATS
+        timing_t frame_end = timing_counter_get();
+        k_spinlock_key_t key = k_spin_lock(&aps_cycle_statistics_lock);
+        aps_cycle_statistics.tx_cycles += timing_cycles_get(&frame_start, &frame_end);
+        aps_cycle_statistics.tx_frames++;
+        k_spin_unlock(&aps_cycle_statistics_lock, key);
+#endif
+    }
+
+    if( bufid ) // Buffer provided by zb_buf_get_out_delayed but not needed any more
+    {
+        zigbee_aps_buf_free(bufid);
+    }
+
+    if( b_aps_tx_backpressure )
+    {
+        // Nothing else will schedule the transmission until the buffer notification or the
+        // backoff alarm comes. Do not wait for them forever
+        k_timer_start(&scheduling_cb_watchdog_timer, K_MSEC(SCHEDULING_CB_TIMEOUT_MS), K_NO_WAIT);
     }
     else
     {
-        //TODO: Implement a mechanism to try to allocate the buffer again after a while
-        zb_err_code = zb_buf_get_out_delayed(zigbee_aps_frame_scheduling_cb);
-        ZB_ERROR_CHECK(zb_err_code);
-        LOG_ERR("Transmission could not be scheduled: Zigbee Out buffer not allocated");
+        k_timer_stop(&scheduling_cb_watchdog_timer);
     }
+    atomic_set(&scheduling_cb_pending, 0);
+}
+
+//------------------------------------------------------------------------------
+/**@brief Schedule the execution of zigbee_aps_frame_scheduling_cb in the Zigbee thread if there are
+ *        pending frames, there is room in the transmission window and it is not already scheduled.
+ *
+ * @note Called from the main loop and from the transmission callback.
+ */
+void zigbee_aps_schedule_transmission(void)
+{
+    if( ( pending_aps_frames() == 0 ) || ( aps_frames_in_flight >= APS_TX_WINDOW_SIZE ) ) return;
+    if( b_aps_tx_backpressure ) return; // The backoff alarm or the buffer notification will schedule it
+
+    if( !atomic_cas(&scheduling_cb_pending, 0, 1) ) return; // Already scheduled
 
-    b_scheduling_cb_pending = false;
+    k_timer_start(&scheduling_cb_watchdog_timer, K_MSEC(SCHEDULING_CB_TIMEOUT_MS), K_NO_WAIT);
+
+    int ret = ZB_SCHEDULE_APP_CALLBACK(zigbee_aps_frame_scheduling_cb,0);
+    if(ret == RET_OK) PACKET_LOG_DBG("Transmission scheduled");
+    else
+    {
+        if(ret == RET_OVERFLOW) LOG_ERR("Transmission could not be scheduled: Scheduling failed RET_OVERFLOW");
+        else LOG_ERR("Transmission could not be scheduled: Unkown error");
+        k_timer_stop(&scheduling_cb_watchdog_timer);
+        atomic_set(&scheduling_cb_pending, 0);
+    }
 }
 
 //------------------------------------------------------------------------------
@@ -268,22 +672,90 @@ void zigbee_aps_frame_scheduling_cb(zb_uint8_t param)
  */
 void zigbee_aps_manager(void)
 {
-    int ret = 0;
-    if( aps_output_frame_buffer.used_space > 0 ) // There is at least an output aps frame pending to be scheduled
+    zigbee_aps_schedule_transmission();
+}
+
+//------------------------------------------------------------------------------
+/**@brief Hand over a received APS frame to the APS rx work queue, where it is passed to its handler.
+ *        The payload is copied once, so the caller can release the stack buffer immediately.
+ *
+ * @note Executed in the Zigbee thread. It does not block: the frame is dropped if the pool is exhausted.
+ *
+ * @retval true The frame has been queued
+ * @retval false The frame has been dropped
+ */
+bool zigbee_aps_post_rx_frame(const zb_apsde_data_indication_t *ind, const zb_uint8_t *payload, zb_uint16_t payload_size)
+{
+    aps_rx_frame_t *frame;
+
+    if( payload_size > APS_RX_PAYLOAD_MAX )
     {
-        if( !b_scheduling_cb_pending )
-        {        
-            b_scheduling_cb_pending = true;
-            scheduling_cb_timer = SCHEDULING_CB_TIMEOUT_MS;
-
-            ret = ZB_SCHEDULE_APP_CALLBACK(zigbee_aps_frame_scheduling_cb,0);
-            if(ret == RET_OK) LOG_DBG("Transmission scheduled");
-            else if(ret == RET_OVERFLOW) LOG_ERR("Transmission could not be scheduled: Scheduling failed RET_OVERFLOW");
-            else LOG_ERR("Transmission could not be scheduled: Unkown error");
-        } 
-        else
+        LOG_ERR("Received APS payload too big %d", payload_size);
+        aps_rx_frames_dropped++;
+        return false;
+    }
+    if( k_mem_slab_alloc(&aps_rx_frame_slab, (void **)&frame, K_NO_WAIT) != 0 )
+    {
+        aps_rx_frames_dropped++;
+        return false;
+    }
+
+    frame->ind = *ind;
+    frame->payload_size = payload_size;
+    memcpy(frame->payload, payload, payload_size);
+
+    // The queue has room for every block of the slab, so this can not fail
+    k_msgq_put(&aps_rx_frame_queue, &frame, K_NO_WAIT);
+    k_work_submit_to_queue(&aps_rx_work_q, &aps_rx_work);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+/**@brief Pass the received APS frames to their handlers and release them.
+ *
+ * @note Executed in the APS rx work queue.
+ */
+static void aps_rx_work_handler(struct k_work *work)
+{
+    aps_rx_frame_t *frame;
+
+    while( k_msgq_get(&aps_rx_frame_queue, &frame, K_NO_WAIT) == 0 )
+    {
+#ifdef CONFIG_TCU_DIAGNOSTICS_CYCLE_STATS
+        timing_t frame_start = timing_counter_get();
+#endif
+        if( !zigbee_aps_dispatch_rx_frame(&frame->ind, frame->payload, frame->payload_size) )
         {
-            LOG_WRN("Transmission could not be scheduled: Scheduling callback already pending");
-        }       
+            aps_rx_frames_without_handler++; // Not logged, any device of the network could flood the log
+            PACKET_LOG_DBG("Rx APS Frame without handler: profile 0x%x, cluster 0x%x, src_ep %d, dest_ep %d, payload %d bytes",
+                           frame->ind.profileid, frame->ind.clusterid, frame->ind.src_endpoint, frame->ind.dst_endpoint,
+                           frame->payload_size);
+        }
+        k_mem_slab_free(&aps_rx_frame_slab, (void *)frame);
+#ifdef CONFIG_TCU_DIAGNOSTICS_CYCLE_STATS
+        timing_t frame_end = timing_counter_get();
+        k_spinlock_key_t key = k_spin_lock(&aps_cycle_statistics_lock);
+        aps_cycle_statistics.rx_cycles += timing_cycles_get(&frame_start, &frame_end);
+        aps_cycle_statistics.rx_frames++;
+        k_spin_unlock(&aps_cycle_statistics_lock, key);
+#endif
     }
 }
+
+//------------------------------------------------------------------------------
+/**@brief Number of received APS frames dropped because they could not be handed over
+ *
+ */
+uint32_t zigbee_aps_get_rx_frames_dropped(void)
+{
+    return aps_rx_frames_dropped;
+}
+
+//------------------------------------------------------------------------------
+/**@brief Number of received APS frames discarded because no handler is registered for them
+ *
+ */
+uint32_t zigbee_aps_get_rx_frames_without_handler(void)
+{
+    return aps_rx_frames_without_handler;
+}
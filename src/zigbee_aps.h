@@ -6,39 +6,119 @@
 #ifndef ZIGBEE_APS_H_
 #define ZIGBEE_APS_H_
 
-#define APS_UNENCRYPTED_PAYLOAD_MAX 82
+#define APS_UNENCRYPTED_PAYLOAD_MAX 82 // Maximum payload of a single APS frame, bigger payloads are split by the producer
 #define APS_PAYLOAD_MAX 255
-#define APS_OUTPUT_FRAME_BUFFER_SIZE 8
+#define APS_CONTROL_FRAME_BUFFER_SIZE 4 // Capacity of the lane of control / management frames (ND, ping, wireless AT replies)
+#define APS_CONTROL_FRAME_PAYLOAD_MAX APS_UNENCRYPTED_PAYLOAD_MAX // Control frames always fit in a single frame
+#ifdef CONFIG_TCU_UART_UPLINK_FRAGMENTATION_STACK
+#define APS_FRAME_PAYLOAD_MAX APS_PAYLOAD_MAX // Whole TCU frames, fragmented by the stack
+#define APS_DATA_FRAME_BUFFER_SIZE 6    // Capacity of the lane of transparent data frames (TCU UART payloads)
+#else
+#define APS_FRAME_PAYLOAD_MAX APS_UNENCRYPTED_PAYLOAD_MAX // Payload of a slot of the data lane
+#define APS_DATA_FRAME_BUFFER_SIZE 15   // Capacity of the lane of transparent data frames (TCU UART payloads)
+#endif
+/* Size of a slot of a lane: the frame header plus the payload, rounded so the next slot stays aligned */
+#define APS_OUTPUT_FRAME_SLOT_SIZE(payload_max) ROUND_UP(sizeof(aps_output_frame_t) + (payload_max), sizeof(uint32_t))
+#define APS_TX_WINDOW_SIZE 3         // Maximum number of APS frames in flight (passed to the stack, transmission not completed)
+/* A frame fragmented by the stack is only passed to it when fewer frames are in flight.
+ * TODO: placeholder, not measured. Tune it with CONFIG_TCU_UART_UPLINK_BENCHMARK in STACK mode */
+#define APS_TX_FRAGMENTED_WINDOW_SIZE 1
+#define APS_TX_FRAMES_PER_CALLBACK 4 // Maximum number of APS frames passed to the stack in each scheduling callback
+#define APS_TX_BACKOFF_MIN_MS 10     // First backoff when the stack runs out of buffers, doubled on every retry
+#define APS_TX_BACKOFF_MAX_MS 640
+#define APS_TX_MAX_RETRIES 8         // Attempts after which the first frame of the queue is dropped
+#define APS_RX_HANDLERS_MAX 8        // Handlers of received APS frames that can be registered
+#define APS_RX_FRAME_POOL_SIZE 8     // Received APS frames waiting to be processed by their handlers
+#define APS_RX_PAYLOAD_MAX APS_PAYLOAD_MAX
+#define APS_RX_WORK_Q_STACK_SIZE 2048
+#define APS_RX_WORK_Q_PRIORITY 5
+
+/* Priority lanes of the aps output frame queue. The lanes are served in strict priority order:
+ * a frame is only taken from a lane when all the lanes with higher priority are empty */
+enum aps_priority_e{
+    APS_PRIORITY_CONTROL, // Node discovery, ping and wireless AT replies
+    APS_PRIORITY_DATA,    // Transparent data
+    APS_NUMBER_OF_PRIORITIES
+};
+
+/* Notification of the end of the transmission of an APS frame (executed in the Zigbee thread)
+ * status: RET_OK if the frame was delivered, otherwise the error
+ * latency_ms: time elapsed since the frame was placed in the queue */
+typedef void (*aps_tx_status_cb_t)(zb_uint16_t handle, zb_ret_t status, uint32_t latency_ms);
 
 typedef struct {
+    uint32_t enqueue_time_ms;
+    aps_tx_status_cb_t status_cb; // Set by the producer before enqueuing the frame. NULL if not needed
     zb_addr_u dst_addr;
     zb_uint16_t cluster_id;
+    zb_uint16_t handle; // Assigned by zigbee_aps_commit_frame, passed to status_cb
     zb_uint8_t dst_endpoint;
     zb_uint8_t src_endpoint;
-    zb_uint8_t payload[APS_PAYLOAD_MAX];
     zb_uint8_t payload_size;
+    zb_uint8_t retries; // Backoffs suffered by the frame while it was the first of the queue
+    zb_uint8_t payload[]; // Sized by the lane: APS_CONTROL_FRAME_PAYLOAD_MAX or APS_FRAME_PAYLOAD_MAX bytes
 } aps_output_frame_t;
 
+/* Single producer (main thread) / single consumer (Zigbee thread) ring, one per priority lane.
+ * head and tail run over [0, 2 * size), so a full lane can be told apart from an empty one
+ * without extra counters */
 typedef struct {
-    aps_output_frame_t data[APS_OUTPUT_FRAME_BUFFER_SIZE];
-    uint16_t head;
-    uint16_t tail;
-    uint16_t free_space;
-    uint16_t used_space;
+    uint8_t *data;            // Storage of the lane, size slots of slot_size bytes
+    uint16_t size;            // Capacity of the lane
+    uint16_t slot_size;       // Bytes of a slot, APS_OUTPUT_FRAME_SLOT_SIZE(payload_max)
+    uint16_t payload_max;     // Biggest payload that fits in a slot of the lane
+    atomic_t head;            // Written only by the producer, after the slot has been filled
+    atomic_t tail;            // Written only by the consumer, after the slot has been used
 } aps_output_frame_circular_buffer_t;
 
+/* Handler of the APS frames received with a given profile, cluster and endpoints (executed in the
+ * APS rx work queue). The payload is only valid during the call */
+typedef void (*aps_rx_handler_t)(const zb_apsde_data_indication_t *ind, zb_uint8_t *payload, zb_uint16_t payload_size);
+
+/* Entry of the table of handlers of received APS frames, sorted by key */
+typedef struct {
+    uint64_t key; // Profile, cluster, source endpoint and destination endpoint
+    aps_rx_handler_t handler;
+} aps_rx_handler_entry_t;
+
+/* Received APS frame, copied out of the stack buffer so the buffer can be released at once.
+ * Allocated from a memory slab and processed in the APS rx work queue */
+typedef struct {
+    zb_apsde_data_indication_t ind; // APS header
+    zb_uint16_t payload_size;
+    zb_uint8_t payload[APS_RX_PAYLOAD_MAX];
+} aps_rx_frame_t;
+
+/* CPU cycles (timing functions) spent in the data path, used to measure the cost of the diagnostics
+ * (compare the averages of builds with different CONFIG_TCU_DIAGNOSTICS_LEVEL) */
+typedef struct {
+    uint32_t rx_frames;
+    uint64_t rx_cycles; // Dispatch of received frames to their handlers, in the APS rx work queue
+    uint32_t tx_frames;
+    uint64_t tx_cycles; // Transfer of output frames to the stack, in the Zigbee thread
+} aps_cycle_statistics_t;
+
 /* Function prototypes (used only internally)                                 */
 void init_aps_output_frame_buffer(void);
-bool enqueue_aps_frame(aps_output_frame_t *element);
-bool dequeue_aps_frame(aps_output_frame_t *element);
 void zigbee_aps_frame_scheduling_cb(zb_uint8_t param);
+void zigbee_aps_schedule_transmission(void);
 
 /* Function prototypes (used externally)                                      */
 void zigbee_aps_init(void);
 void zigbee_aps_user_data_tx_cb(zb_bufid_t bufid);
-uint16_t zigbee_aps_get_output_frame_buffer_free_space(void);
+void zigbee_aps_buf_free(zb_bufid_t bufid);
+uint16_t zigbee_aps_get_output_frame_buffer_free_space(uint8_t priority);
+aps_output_frame_t *zigbee_aps_reserve_frame(uint8_t priority);
+zb_uint16_t zigbee_aps_commit_frame(uint8_t priority);
 void zigbee_aps_manager(void);
-void check_scheduling_cb_timeout(void);
+uint8_t zigbee_aps_get_frames_in_flight(void);
+void zigbee_aps_get_cycle_statistics(aps_cycle_statistics_t *statistics);
+bool zigbee_aps_register_rx_handler(zb_uint16_t profile_id, zb_uint16_t cluster_id, zb_uint8_t src_endpoint,
+                                    zb_uint8_t dst_endpoint, aps_rx_handler_t handler);
+bool zigbee_aps_dispatch_rx_frame(const zb_apsde_data_indication_t *ind, zb_uint8_t *payload, zb_uint16_t payload_size);
+bool zigbee_aps_post_rx_frame(const zb_apsde_data_indication_t *ind, const zb_uint8_t *payload, zb_uint16_t payload_size);
+uint32_t zigbee_aps_get_rx_frames_dropped(void);
+uint32_t zigbee_aps_get_rx_frames_without_handler(void);
 
 #endif /* ZIGBEE_APS_H_ */
 
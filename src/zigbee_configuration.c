@@ -14,6 +14,7 @@
 #include "zigbee_configuration.h"
 #include "Digi_At_commands.h"
 #include "nvram.h"
+#include "global_defines.h"
 #include <zephyr/sys/reboot.h>
 
 LOG_MODULE_REGISTER(zb_conf, LOG_LEVEL_DBG);
@@ -348,7 +349,7 @@ uint8_t zb_conf_get_extended_node_identifier (uint8_t *ni)
         if( ni[i] == '\0' ) break;
     }
     if( ni[i] != '\0' ) ni[i] = '\0';
-    LOG_WRN("Node Identifier: %s", ni);
+    PACKET_LOG_DBG("Node Identifier: %s", ni);
     return(i);
 }
 
@@ -11,6 +11,7 @@
 #include <zephyr/kernel.h>
 #include <zephyr/device.h>
 #include <zephyr/logging/log.h>
+#include <string.h>
 #include <dk_buttons_and_leds.h>
 
 #include <zboss_api.h>
@@ -19,6 +20,7 @@
 #include <zigbee/zigbee_app_utils.h>
 #include <zb_nrf_platform.h>
 #include "zb_range_extender.h"
+#include "../src/Digi_profile.h" /* Profile, clusters and uplink frame format of the TCU routers */
 
 
 #define RUN_STATUS_LED                         DK_LED1
@@ -49,6 +51,18 @@
 
 #define ZIGBEE_PERMIT_LEGACY_DEVICES           ZB_FALSE
 
+/* Uplink frames of the TCU routers (DIGI_PROFILE_ID):
+ * - DIGI_AGGREGATED_DATA_CLUSTER: each record of the APS payload is one TCU frame preceded by
+ *   its length.
+ * - DIGI_FRAGMENTED_DATA_CLUSTER: each fragment starts with the message id, the index of the
+ *   fragment and the number of fragments (DIGI_FRAGMENT_HEADER_SIZE). All the fragments but the
+ *   last one carry DIGI_FRAGMENT_DATA_MAX bytes.
+ */
+#define REASSEMBLY_MAX_FRAME_SIZE              256
+#define REASSEMBLY_MAX_FRAGMENTS               ((REASSEMBLY_MAX_FRAME_SIZE + DIGI_FRAGMENT_DATA_MAX - 1) / DIGI_FRAGMENT_DATA_MAX)
+#define REASSEMBLY_SLOTS                       4    /* Routers whose frames can be reassembled at the same time */
+#define REASSEMBLY_TIMEOUT_MS                  2000 /* Time after the first fragment to receive the rest */
+
 #ifndef ZB_COORDINATOR_ROLE
 #error Define ZB_COORDINATOR_ROLE to compile coordinator source code.
 #endif
@@ -75,6 +89,20 @@ struct zb_device_ctx {
 /* Zigbee device application context storage. */
 static struct zb_device_ctx dev_ctx;
 
+/* Frame being reassembled from the fragments sent by one router. */
+struct reassembly_slot {
+	bool in_use;
+	zb_uint16_t src_addr;
+	zb_uint8_t message_id;
+	zb_uint8_t fragment_count;
+	zb_uint8_t received_mask;
+	zb_uint16_t frame_size;
+	int64_t start_time_ms;
+	zb_uint8_t frame[REASSEMBLY_MAX_FRAME_SIZE];
+};
+
+static struct reassembly_slot reassembly_slots[REASSEMBLY_SLOTS];
+
 ZB_ZCL_DECLARE_IDENTIFY_ATTRIB_LIST(
 	identify_attr_list,
 	&dev_ctx.identify_attr.identify_time);
@@ -246,6 +274,158 @@ static void configure_gpio(void)
 	}
 }
 
+/**@brief Split an aggregated uplink frame into the TCU frames it carries.
+ *
+ * @param[in]   ind            APS header of the received frame.
+ * @param[in]   payload        APS payload.
+ * @param[in]   payload_size   Size of the APS payload.
+ */
+static void deaggregate_frame(const zb_apsde_data_indication_t *ind,
+			      const zb_uint8_t *payload, zb_uint32_t payload_size)
+{
+	zb_uint32_t offset = 0;
+	zb_uint8_t record_size;
+
+	while (offset < payload_size) {
+		record_size = payload[offset++];
+		if ((record_size == 0) || (offset + record_size > payload_size)) {
+			LOG_WRN("Malformed aggregated frame from 0x%04hx", ind->src_addr);
+			break;
+		}
+		LOG_HEXDUMP_INF(&payload[offset], record_size, "TCU frame");
+		offset += record_size;
+	}
+}
+
+/**@brief Get the reassembly slot of a router, releasing the slots whose frame has timed out.
+ *        A free slot is assigned if the router has none.
+ *
+ * @param[in]   src_addr   Short address of the router.
+ *
+ * @retval Pointer to the slot, or NULL if all the slots are in use.
+ */
+static struct reassembly_slot *get_reassembly_slot(zb_uint16_t src_addr)
+{
+	struct reassembly_slot *free_slot = NULL;
+	int64_t time_now_ms = k_uptime_get();
+
+	for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+		struct reassembly_slot *slot = &reassembly_slots[i];
+
+		if (slot->in_use &&
+		    (time_now_ms - slot->start_time_ms > REASSEMBLY_TIMEOUT_MS)) {
+			LOG_WRN("Incomplete frame %d from 0x%04hx discarded (timeout)",
+				slot->message_id, slot->src_addr);
+			slot->in_use = false;
+		}
+		if (slot->in_use && (slot->src_addr == src_addr)) {
+			return slot;
+		}
+		if (!slot->in_use && (free_slot == NULL)) {
+			free_slot = slot;
+		}
+	}
+
+	if (free_slot != NULL) {
+		free_slot->in_use = true;
+		free_slot->src_addr = src_addr;
+		free_slot->fragment_count = 0; /* No fragment yet */
+	}
+	return free_slot;
+}
+
+/**@brief Store a fragment of an uplink frame. The frame is delivered when all its fragments
+ *        have been received, in any order. Frames with missing fragments are discarded when
+ *        the timeout expires or a fragment of another frame arrives from the same router.
+ *
+ * @param[in]   ind            APS header of the received frame.
+ * @param[in]   payload        APS payload (fragment header and data).
+ * @param[in]   payload_size   Size of the APS payload.
+ */
+static void reassemble_fragment(const zb_apsde_data_indication_t *ind,
+				const zb_uint8_t *payload, zb_uint32_t payload_size)
+{
+	struct reassembly_slot *slot;
+	zb_uint8_t message_id, index, count;
+	zb_uint32_t data_size;
+
+	if (payload_size <= DIGI_FRAGMENT_HEADER_SIZE) {
+		LOG_WRN("Malformed fragment from 0x%04hx", ind->src_addr);
+		return;
+	}
+	message_id = payload[0];
+	index = payload[1];
+	count = payload[2];
+	data_size = payload_size - DIGI_FRAGMENT_HEADER_SIZE;
+
+	if ((count == 0) || (count > REASSEMBLY_MAX_FRAGMENTS) || (index >= count) ||
+	    ((index < count - 1) && (data_size != DIGI_FRAGMENT_DATA_MAX)) ||
+	    (data_size > DIGI_FRAGMENT_DATA_MAX) ||
+	    (index * DIGI_FRAGMENT_DATA_MAX + data_size > REASSEMBLY_MAX_FRAME_SIZE)) {
+		LOG_WRN("Malformed fragment from 0x%04hx", ind->src_addr);
+		return;
+	}
+
+	slot = get_reassembly_slot(ind->src_addr);
+	if (slot == NULL) {
+		LOG_WRN("No reassembly slot for the fragments of 0x%04hx", ind->src_addr);
+		return;
+	}
+
+	if ((slot->fragment_count != 0) &&
+	    ((slot->message_id != message_id) || (slot->fragment_count != count))) {
+		LOG_WRN("Incomplete frame %d from 0x%04hx discarded", slot->message_id,
+			slot->src_addr);
+		slot->fragment_count = 0;
+	}
+	if (slot->fragment_count == 0) {
+		slot->message_id = message_id;
+		slot->fragment_count = count;
+		slot->received_mask = 0;
+		slot->frame_size = 0;
+		slot->start_time_ms = k_uptime_get();
+	}
+
+	memcpy(&slot->frame[index * DIGI_FRAGMENT_DATA_MAX], &payload[DIGI_FRAGMENT_HEADER_SIZE], data_size);
+	slot->received_mask |= BIT(index);
+	if (index == count - 1) {
+		slot->frame_size = index * DIGI_FRAGMENT_DATA_MAX + data_size;
+	}
+
+	if (slot->received_mask == BIT_MASK(count)) {
+		/* Only logged, the coordinator has no host interface to pass the frame to */
+		LOG_HEXDUMP_INF(slot->frame, slot->frame_size, "TCU frame");
+		slot->in_use = false;
+	}
+}
+
+/**@brief Deliver the uplink frames of the TCU routers that are aggregated or fragmented.
+ *
+ * @param[in]   bufid   Reference to the Zigbee stack buffer with the received APS frame.
+ *
+ * @retval ZB_TRUE   The frame has been processed and the buffer has been freed.
+ * @retval ZB_FALSE  Other frame, left to the stack.
+ */
+static zb_uint8_t data_indication_cb(zb_bufid_t bufid)
+{
+	zb_apsde_data_indication_t *ind = ZB_BUF_GET_PARAM(bufid, zb_apsde_data_indication_t);
+
+	if (ind->profileid != DIGI_PROFILE_ID) {
+		return ZB_FALSE;
+	}
+
+	if (ind->clusterid == DIGI_AGGREGATED_DATA_CLUSTER) {
+		deaggregate_frame(ind, zb_buf_begin(bufid), zb_buf_len(bufid));
+	} else if (ind->clusterid == DIGI_FRAGMENTED_DATA_CLUSTER) {
+		reassemble_fragment(ind, zb_buf_begin(bufid), zb_buf_len(bufid));
+	} else {
+		return ZB_FALSE;
+	}
+
+	zb_buf_free(bufid);
+	return ZB_TRUE;
+}
+
 /**@brief Zigbee stack event handler.
  *
  * @param[in]   bufid   Reference to the Zigbee stack buffer used to pass signal.
@@ -367,6 +547,9 @@ int main(void)
 	/* Register handlers to identify notifications. */
 	ZB_AF_SET_IDENTIFY_NOTIFICATION_HANDLER(ZIGBEE_COORDINATOR_ENDPOINT, identify_cb);
 
+	/* Register handler of the aggregated and fragmented uplink frames. */
+	zb_af_set_data_indication(data_indication_cb);
+
 	/* Start Zigbee default thread */
 	zigbee_enable();
 